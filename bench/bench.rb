@@ -0,0 +1,72 @@
+# Drive one pinger against the targets set up by bench/run.sh and print
+# one "key value" line per measure.
+# 
+# usage: mruby bench.rb icmp|arp|simulated <targets> <rounds>
+# 
+# simulated needs neither root nor bench/run.sh, the replies come
+# from the simulated network with a fixed 1ms latency
+# 
+mode = ARGV[0]
+count = ARGV[1].to_i
+rounds = ARGV[2].to_i
+
+# keep in sync with bench/run.sh
+def icmp_target(i)
+  "10.98.#{i / 250}.#{i % 250 + 2}"
+end
+
+def arp_target(i)
+  "10.99.#{i / 250}.#{i % 250 + 2}"
+end
+
+case mode
+when 'icmp'
+  pinger = ICMPPinger.new
+  count.times{|i| pinger.add_target(icmp_target(i)) }
+  
+when 'simulated'
+  pinger = ICMPPinger.new(backend: :simulated, simulation: {min_delay: 1000})
+  count.times{|i| pinger.add_target(icmp_target(i)) }
+  
+when 'arp'
+  pinger = ARPPinger.new('mrbb0', '10.99.255.1')
+  pinger.set_targets( (0...count).map{|i| arp_target(i) } )
+  
+else
+  raise "unknown mode: #{mode}"
+end
+
+# the first cycle creates the sockets and fills the caches
+pinger.send_pings(2000, 1, 0)
+
+elapsed = 0.0
+matched = 0
+rtt_sum = 0
+
+rounds.times do
+  started_at = Time.now
+  ret = pinger.send_pings(2000, 1, 0)
+  elapsed += Time.now - started_at
+  
+  ret.each do |_, stats|
+    # [average, loss, ...]
+    if stats[1] == 0.0
+      matched += 1
+      rtt_sum += stats[0]
+    end
+  end
+end
+
+sent = count * rounds
+
+puts "sent #{sent}"
+puts "matched #{matched}"
+puts "elapsed_ms #{(elapsed * 1000).to_i}"
+puts "sends_per_sec #{(sent / elapsed).to_i}"
+puts "matched_per_sec #{(matched / elapsed).to_i}"
+puts "avg_rtt_usec #{matched > 0 ? rtt_sum / matched : 0}"
+
+# pinger side counters, they include the warmup cycle
+if pinger.respond_to?(:stats)
+  pinger.stats.each{|name, value| puts "stats_#{name} #{value}" }
+end
@@ -0,0 +1,103 @@
+#!/bin/sh
+# 
+# Benchmark ICMPPinger and ARPPinger against a network namespace
+# connected with a veth pair, needs root.
+# 
+# usage: bench/run.sh <mruby binary> [targets] [rounds]
+# 
+# the namespace answers for 10.98.0.0/16 (icmp targets, routed through
+# the veth) and for 10.99.0.0/17 (arp targets, on link), the host side
+# of the veth is 10.99.255.1
+# 
+set -e
+
+MRUBY=$1
+TARGETS=${2:-1000}
+ROUNDS=${3:-5}
+NS=mrbping-bench
+DIR=$(dirname "$0")
+TMP=$(mktemp -d)
+
+if [ -z "$MRUBY" ]; then
+  echo "usage: $0 <mruby binary> [targets] [rounds]" >&2
+  exit 1
+fi
+
+if [ "$TARGETS" -gt 31750 ]; then
+  echo "at most 31750 targets" >&2
+  exit 1
+fi
+
+cleanup() {
+  ip netns del $NS 2>/dev/null || true
+  ip link del mrbb0 2>/dev/null || true
+  rm -rf "$TMP"
+}
+
+trap cleanup EXIT
+cleanup
+mkdir -p "$TMP"
+
+ip netns add $NS
+ip link add mrbb0 type veth peer name mrbb1
+ip link set mrbb1 netns $NS
+
+ip addr add 10.99.255.1/16 dev mrbb0
+ip link set mrbb0 up
+ip route add 10.98.0.0/16 via 10.99.255.2 dev mrbb0
+
+ip -n $NS link set lo up
+ip -n $NS addr add 10.99.255.2/16 dev mrbb1
+ip -n $NS link set mrbb1 up
+
+# any address in these ranges is local to the namespace, it answers
+# the echo requests and the arp requests for all of them
+ip -n $NS route add local 10.98.0.0/16 dev lo
+ip -n $NS route add local 10.99.0.0/17 dev lo
+
+# let the veth settle
+sleep 1
+
+# run one pinger, print its measures followed by "cpu_ms" and "maxrss_kb"
+# when GNU time is available
+measure() {
+  if [ -x /usr/bin/time ]; then
+    /usr/bin/time -f "cpu_ms %e %U %S\nmaxrss_kb %M" -o "$TMP/time" "$MRUBY" "$DIR/bench.rb" "$@"
+    awk '/^cpu_ms/ { printf "cpu_ms %d\n", ($3 + $4) * 1000 } /^maxrss_kb/ { print }' "$TMP/time"
+  else
+    "$MRUBY" "$DIR/bench.rb" "$@"
+  fi
+}
+
+value() {
+  awk -v key="$1" '$1 == key { print $2 }' "$2"
+}
+
+# reference latency measured by the kernel stack and ping(8)
+KERNEL_RTT=$(ping -q -c 100 -i 0.01 10.98.0.2 | awk -F/ '/^rtt|^round-trip/ { printf "%d", $5 * 1000 }')
+
+echo "kernel ping avg rtt: ${KERNEL_RTT} usec"
+
+for mode in icmp arp; do
+  measure $mode 1 1 > "$TMP/$mode.base"
+  measure $mode "$TARGETS" "$ROUNDS" > "$TMP/$mode"
+  
+  echo ""
+  echo "== $mode: $TARGETS targets, $ROUNDS rounds"
+  cat "$TMP/$mode"
+  
+  if [ "$mode" = icmp ]; then
+    echo "rtt_overhead_usec $(( $(value avg_rtt_usec "$TMP/$mode") - KERNEL_RTT ))"
+  fi
+  
+  if [ -n "$(value cpu_ms "$TMP/$mode")" ]; then
+    # the process cpu time includes the warm up cycle, the memory is
+    # compared with a run with a single target
+    awk -v cpu="$(value cpu_ms "$TMP/$mode")" -v rss="$(value maxrss_kb "$TMP/$mode")" \
+        -v base="$(value maxrss_kb "$TMP/$mode.base")" -v targets="$TARGETS" -v cycles=$((ROUNDS + 1)) 'BEGIN {
+      printf "cpu_ms_per_1k_targets_per_cycle %.3f\n", cpu * 1000 / (targets * cycles)
+      if( targets > 1 )
+        printf "memory_bytes_per_target %d\n", (rss - base) * 1024 / (targets - 1)
+    }'
+  fi
+done
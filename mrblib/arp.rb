@@ -0,0 +1,14 @@
+class ARPPinger
+  
+  ##
+  # Create a pinger whose arp requests never leave the host, the replies
+  # come from a simulated network where each target answers from the
+  # mac address 02:00 followed by its ip (linux only).
+  # 
+  # @param [Hash] simulation same options as the :simulation option of ICMPPinger
+  # @param [String] ip_source source address of the requests
+  def self.simulated(simulation = {}, ip_source = '10.0.0.1')
+    new('simulated', ip_source, PingSimulation.config(simulation))
+  end
+  
+end
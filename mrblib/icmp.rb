@@ -1,25 +1,81 @@
 class ICMPPinger
   
-  def initialize
-    internal_init()
+  ##
+  # @param [Hash] opts
+  # @option opts [Integer] :max_pps maximum number of icmp requests sent per second
+  # @option opts [Symbol] :backend :raw (default, needs root), :dgram to use
+  #   unprivileged icmp sockets (linux only, see net.ipv4.ping_group_range)
+  #   or :simulated for load testing without network (see :simulation),
+  #   the :uid option of the targets is ignored with :dgram
+  # @option opts [Integer] :workers number of threads the targets are sharded over,
+  #   each one with its own sockets, sender and receiver (linux only)
+  # @option opts [Symbol] :timestamping :kernel to measure the latency from the time
+  #   the driver sent the request instead of the time we asked to send it (linux only)
+  # @option opts [Hash] :simulation settings of the :simulated backend, no packet
+  #   leaves the host and the replies come from a simulated network (linux only):
+  #   :min_delay and :max_delay bound the latency of each target (in usec),
+  #   :jitter (in usec), :loss and :reorder probabilities (between 0 and 1) and
+  #   :seed, the same seed gives the same latencies and losses
+  def initialize(opts = {})
+    simulation = nil
+    
+    if opts[:backend] == :simulated
+      simulation = PingSimulation.config(opts[:simulation] || {})
+    end
+    
+    internal_init(opts[:backend] == :dgram, opts[:workers] || 1, opts[:timestamping] == :kernel, simulation)
     
     @targets = []
     @init_done = false
+    
+    self.max_pps = opts[:max_pps] if opts[:max_pps]
   end
   
+  ##
+  # Limit the send rate, the requests of each batch are already spread
+  # over the delay, this only makes the spacing larger.
+  # 
+  # @param [Integer] pps maximum number of requests per second, 0 for no limit
+  def max_pps=(pps)
+    _set_max_pps(pps)
+  end
+
+  ##
+  # Once the pinger has been used the target is added in place, the
+  # existing targets and their sockets are left untouched.
+  # 
+  # @param [String] addr ip address
+  # @option opts [Integer] :routing_table
+  # @option opts [Integer] :uid icmp id, also the id of the target in the results
+  # @option opts [String] :interface
+  # @option opts [String] :source_address
   def add_target(addr, opts = {})
-    @targets << [
-      addr,
-      opts.delete(:routing_table) || 0,
-      opts.delete(:uid) || 0,
-      opts.delete(:interface),
-      opts.delete(:source_address)
-    ]
+    target = target_entry(addr, opts)
+    
+    _add_targets([target]) if @init_done
+    @targets << target
+  end
+  
+  ##
+  # Remove a target added with the same arguments, its sockets are closed
+  # when no other target uses them. The last target takes the place of the
+  # removed one, the ids of the targets without :uid do not change.
+  # 
+  # @return [Boolean] false if there was no such target
+  def remove_target(addr, opts = {})
+    index = @targets.index(target_entry(addr, opts))
+    return false unless index
+    
+    _remove_targets([index]) if @init_done
+    
+    last = @targets.pop
+    @targets[index] = last if index < @targets.size
+    true
   end
   
   def clear_targets
-    @init_done = false
     _clear_targets()
+    @targets = []
   end
   
   def has_targets?
@@ -30,65 +86,133 @@ class ICMPPinger
   # @param [Integer] timeout how much time to wait for all the replies (in ms)
   # @param [Integer] count how many icmp request to send
   # @param [Integer] delay how much time to wait before each icmp requests batch
-  def send_pings(timeout, count = 1, delay = 50, wanted_percentiles = [])
+  # @param [Array] wanted_percentiles percentiles to compute (between 0 and 1)
+  # 
+  # @return [Hash] [average, loss percentage, {percentile => latency}, min, max, stddev, jitter]
+  #   for each target, latencies are in usec
+  # 
+  # The call returns as soon as every request got its reply, when a block
+  # is given it is called with (id, seq, latency) as each reply comes in.
+  def send_pings(timeout, count = 1, delay = 50, wanted_percentiles = [], &block)
+    prepare_cycle(timeout, count, delay)
+    _send_pings(timeout, count, delay, wanted_percentiles, &block)
+  end
+  
+  ##
+  # Same as #send_pings but the results are kept in C arrays and only
+  # turned into ruby values when asked for, with many targets this
+  # avoids creating an array and a hash per target on each call.
+  # 
+  # @return [PingResults] the same object is reused and overwritten by
+  #   the next call
+  def send_pings_results(timeout, count = 1, delay = 50, &block)
+    prepare_cycle(timeout, count, delay)
+    _send_pings(timeout, count, delay, [], true, &block)
+  end
+  
+  ##
+  # Same as #send_pings but return at once, the requests are sent by
+  # background threads (linux only).
+  # 
+  # @param [Integer] timeout how much time to wait for all the replies (in ms)
+  # @param [Integer] count how many icmp request to send
+  # @param [Integer] delay how much time to wait before each icmp requests batch
+  # 
+  # @return [Integer] a descriptor to watch for readability in the event loop,
+  #   when it is readable call #drain to get the new replies and #step to
+  #   know if the cycle is finished
+  def start_pings(timeout, count = 1, delay = 50)
+    prepare_cycle(timeout, count, delay)
+    _start_pings(timeout, count, delay)
+  end
+  
+  ##
+  # @param [Integer] max maximum number of replies returned, 0 for all of
+  #   them, the descriptor stays readable if some are left
+  # 
+  # @return [Array] [id, seq, latency] for each reply received since the last call
+  def drain(max = 0)
+    _drain(max)
+  end
+  
+  ##
+  # @param [Array] wanted_percentiles percentiles to compute (between 0 and 1)
+  # 
+  # @return [Hash,nil] the results of the cycle started by #start_pings in the
+  #   #send_pings format once every request got its reply or the timeout is
+  #   reached, nil while it is still running
+  def step(wanted_percentiles = [])
+    _step(wanted_percentiles)
+  end
+
+  ##
+  # Start sending icmp requests to all the targets in the background,
+  # the results are fetched with #collect.
+  # 
+  # @param [Integer] interval how much time between two requests to the same target (in ms)
+  # @param [Integer] timeout how much time to wait for a reply (in ms)
+  def start_monitoring(interval, timeout)
     unless @init_done
       _set_targets(@targets)
       @init_done = true
     end
     
-    # sanity check
-    if( delay * count >= timeout )
-      raise "delay * count should be higher than timeout !"
-    end
-    
-    ret1 = _send_pings(timeout, count, delay)
-    ret2 = {}
-    
-    # do the maths
-    ret1.each do |host, latencies|
-      sum = loss = 0
-      latencies.each do |n|
-        if n
-          sum += n
-        else
-          loss += 1
-        end
-      end
-      
-      if latencies.all?{|n| n == nil }
-        ret2[host] = [nil, (loss / latencies.size()) * 100, {}]
-      else
-        ret2[host] = [sum / latencies.size(), (loss / latencies.size()) * 100, {}]
-      end
-      
-      unless wanted_percentiles.empty?
-        percentiles(latencies, wanted_percentiles).each do |arr|
-          p, val = *arr
-          ret2[host][-1][p] = val
-        end
-      end
-      
-    end
-    
-    ret2
+    _start_monitoring(interval, timeout)
+  end
+  
+  ##
+  # Return the results gathered since the last call, requests still
+  # waiting for their reply are not accounted yet. It can be called once
+  # more after #stop_monitoring, the results are dropped when the targets
+  # change.
+  # 
+  # @return [Hash] same format as #send_pings without the percentiles
+  def collect
+    _collect()
+  end
+  
+  ##
+  # Counters of what the pinger itself did since it was created, they
+  # tell if the missing replies were lost on the network or on this host.
+  # 
+  # @return [Hash] with these keys:
+  #   - :built, :sent, :send_errors echo requests
+  #   - :recv_calls, :received receive syscalls and packets read
+  #   - :matched replies to our requests
+  #   - :unmatched foreign packets and duplicates
+  #   - :late replies past the timeout or to a finished round
+  #   - :wakeups returns from epoll_wait/select in the receivers
+  #   - :kernel_drops packets dropped because a socket queue was full (linux only)
+  #   - :simulator_drops replies the :simulated backend dropped because
+  #     the pinger did not read them fast enough
+  #   - :build_usec, :send_usec, :receive_usec, :aggregate_usec time spent
+  #     building the requests, sending them, reading the replies and
+  #     building the results
+  def stats
+    _stats()
   end
 
 private
-  def percentiles(values, perc)
-    values_sorted = values.reject{|v| v == nil }
-    values_sorted.sort!
-    len = values_sorted.size
+  def target_entry(addr, opts)
+    [
+      addr,
+      opts.delete(:routing_table) || 0,
+      opts.delete(:uid) || 0,
+      opts.delete(:interface),
+      opts.delete(:source_address)
+    ]
+  end
+  
+  def prepare_cycle(timeout, count, delay)
+    unless @init_done
+      _set_targets(@targets)
+      @init_done = true
+    end
     
-    if values_sorted.size < 3
-      {}
-    else
-      perc.map do |p|
-        k = (p*(len-1)+1).floor - 1
-        f = (p*(len-1)+1) % 1
-
-        [p, values_sorted[k] + (f * (values_sorted[k+1] - values_sorted[k]))]
-      end
+    # sanity check
+    if( delay * count >= timeout )
+      raise "delay * count should be higher than timeout !"
     end
   end
-    
+  
 end
@@ -0,0 +1,23 @@
+##
+# Results of ICMPPinger#send_pings_results, targets are accessed by
+# index (0...size) and the values are only built when asked for:
+# - id(i) the target id, as the keys of the #send_pings hash
+# - rtt(i, round) latency in usec, nil if no reply came back
+# - loss(i), average(i)
+# - stats(i, wanted_percentiles = nil) same array as #send_pings
+# - each(wanted_percentiles = nil){|id, stats| }
+# 
+class PingResults
+  include Enumerable
+  
+  ##
+  # @param [Array] wanted_percentiles percentiles to compute (between 0 and 1)
+  # 
+  # @return [Hash] the results in the ICMPPinger#send_pings format
+  def to_h(wanted_percentiles = [])
+    ret = {}
+    each(wanted_percentiles){|id, stats| ret[id] = stats }
+    ret
+  end
+  
+end
@@ -0,0 +1,23 @@
+module PingSimulation
+  
+  ##
+  # Turn the :simulation options into what the C side expects.
+  # 
+  # @param [Hash] sim :min_delay and :max_delay (in usec), :jitter (in usec),
+  #   :loss and :reorder (between 0 and 1), :seed
+  # 
+  # @return [Array] [min_delay, max_delay, jitter, loss, reorder, seed]
+  def self.config(sim)
+    min_delay = sim[:min_delay] || 1000
+    
+    [
+      min_delay,
+      sim[:max_delay] || min_delay,
+      sim[:jitter] || 0,
+      sim[:loss] || 0,
+      sim[:reorder] || 0,
+      sim[:seed] || 1
+    ]
+  end
+  
+end
@@ -1,29 +1,156 @@
+// sendmmsg (glibc), before mruby-ping.h which includes the system headers
+#define _GNU_SOURCE
 
 #include "mruby-ping.h"
 
 #include <pcap.h>
 #include <libnet.h>
 #include <math.h>
+#include <poll.h>
+#include <time.h>
+
+#ifdef __linux__
+// replies are read from a memory mapped packet ring (TPACKET_V3) instead
+// of going through libpcap
+#define HAVE_PACKET_RING
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+#include <sys/mman.h>
+
+// the ring is made of RING_BLOCK_COUNT blocks of RING_BLOCK_SIZE bytes,
+// the kernel hands us a block when it is full or after RING_BLOCK_TIMEOUT ms
+#define RING_BLOCK_SIZE (1 << 16)
+#define RING_BLOCK_COUNT 32
+#define RING_FRAME_SIZE 128
+#define RING_BLOCK_TIMEOUT 10
+
+// the requests can go to a simulated network instead (simulator.c)
+#define HAVE_SIMULATOR
+
+// the requests are sent on the packet socket of the ring
+#define HAVE_SENDMMSG
+#endif
+
+// only the ethernet and arp headers are needed
+#define REPLY_SNAPLEN 64
+
+// ethernet header + arp request for ipv4
+#define ARP_FRAME_SIZE (LIBNET_ETH_H + LIBNET_ARP_ETH_IP_H)
+
+// how many requests are sent before reading the replies again
+#define SEND_BATCH_SIZE 64
 
 
 #define ERR(MSG) { mrb_raise(mrb, E_RUNTIME_ERROR, MSG); return self; }
 #define ERRF(MSG, FORMAT, ARGS...) { mrb_raisef(mrb, E_RUNTIME_ERROR, FORMAT, ## ARGS); return self; }
 
 
-static pcap_t *pcap;
+struct arp_probe {
+  struct timespec sent_at;
+  struct timespec received_at;
+};
 
+// what we last learned about a target
+struct neighbor {
+  uint8_t         mac[6];
+  struct timespec seen_at;  // capture time of the last reply (CLOCK_REALTIME)
+  mrb_int         rtt;      // latency of the last reply (usec)
+};
 
 // internal state
 struct arp_state {
   libnet_t *ctx;
   
+  // opened once, only receives the arp replies sent to us
+#ifdef HAVE_PACKET_RING
+  int ring_fd;
+  uint8_t *ring;
+  uint32_t ring_block;
+#else
+  pcap_t *pcap;
+#endif
+  struct libnet_ether_addr hwaddr;
+  
+#ifdef HAVE_SIMULATOR
+  // no interface, the requests are written to sim_send_fd and the
+  // replies are read from sim_recv_fd
+  struct simulator *sim;
+  int sim_send_fd;
+  int sim_recv_fd;
+#endif
+  
   in_addr_t ip_source;
   struct target_address *targets;
-  uint16_t targets_count;
+  uint32_t targets_count;
+  
+  // the arp request of each target, built by set_targets
+  uint8_t *frames;
+  
+  // maximum number of requests sent per second, 0 means no limit
+  mrb_int max_pps;
+  
+  // one entry per target, the targets which answered less than cache_ttl
+  // ms ago (seen after fresh_after) are not asked again, 0 disables it
+  struct neighbor *neighbors;
+  mrb_int cache_ttl;
+  struct timespec fresh_after;
+  
+  // ip -> target index + 1 (open addressing, 0 is an empty slot)
+  uint32_t *lookup;
+  uint32_t lookup_mask;
+  
+  // one row of targets_count probes for each round
+  struct arp_probe *probes;
+  uint32_t probes_capacity;
+  uint16_t round;
+  uint32_t sent, received;
+  
+  // latencies of one target, used to compute the percentiles
+  mrb_int *samples;
+  uint32_t samples_capacity;
 };
 
 static void arp_state_free(mrb_state *mrb, void *ptr)
 {
+  struct arp_state *st = (struct arp_state *)ptr;
+  
+#ifdef HAVE_PACKET_RING
+  if( st->ring != NULL )
+    munmap(st->ring, RING_BLOCK_SIZE * RING_BLOCK_COUNT);
+  
+  if( st->ring_fd != -1 )
+    close(st->ring_fd);
+#else
+  if( st->pcap != NULL )
+    pcap_close(st->pcap);
+#endif
+  
+#ifdef HAVE_SIMULATOR
+  if( st->sim != NULL )
+    simulator_stop(st->sim);
+#endif
+  
+  if( st->ctx != NULL )
+    libnet_destroy(st->ctx);
+  
+  if( st->targets != NULL )
+    mrb_free(mrb, st->targets);
+  
+  if( st->lookup != NULL )
+    mrb_free(mrb, st->lookup);
+  
+  if( st->frames != NULL )
+    mrb_free(mrb, st->frames);
+  
+  if( st->neighbors != NULL )
+    mrb_free(mrb, st->neighbors);
+  
+  if( st->probes != NULL )
+    mrb_free(mrb, st->probes);
+  
+  if( st->samples != NULL )
+    mrb_free(mrb, st->samples);
+  
   mrb_free(mrb, ptr);
 }
 
@@ -36,55 +163,37 @@ static struct mrb_data_type arp_ping_state_type = { "ARPPinger", arp_state_free
 
 // internals
 
-static uint8_t broadcast_mac_addr[8] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+struct arp_frame {
+  struct libnet_ethernet_hdr  eth;
+  struct libnet_arp_hdr       arp;
+  uint8_t                     sender_hw[6];
+  uint8_t                     sender_ip[4];
+  uint8_t                     target_hw[6];
+  uint8_t                     target_ip[4];
+} __attribute__((packed));
 
-#define ERRLN(FORMAT, ARGS...) { printf(FORMAT, ## ARGS); libnet_clear_packet(pnet); return -1; }
+static uint32_t target_hash(in_addr_t addr)
+{
+  return ntohl(addr) * 2654435761u;
+}
 
-static int arp_send(
-  libnet_t    *pnet,
-  int          opcode,
-  uint8_t     *source_hardware,
-  in_addr_t    source_address,
-  uint8_t     *target_hardware,
-  in_addr_t    target_address)
+// return the index of the target with this address or -1
+static int64_t find_target(const struct arp_state *st, in_addr_t addr)
 {
-  int retval = -1;
+  uint32_t slot = target_hash(addr) & st->lookup_mask;
   
-  if( source_hardware == NULL ){
-    source_hardware = (uint8_t *) libnet_get_hwaddr(pnet);
-    if( source_hardware == NULL )
-      ERRLN("error obtaining source hardware address : %s\n", libnet_geterror( pnet ));
-  }
+  while( st->lookup[slot] != 0 ){
+    uint32_t idx = st->lookup[slot] - 1;
+    
+    if( st->targets[idx].in_addr == addr )
+      return idx;
     
-  if( target_hardware == NULL ){
-    target_hardware = broadcast_mac_addr;
+    slot = (slot + 1) & st->lookup_mask;
   }
   
-  if( libnet_autobuild_arp( opcode, source_hardware, (uint8_t *)&source_address, target_hardware, (uint8_t *)&target_address, pnet ) == -1 )
-    ERRLN("error building arp packet : %s\n", libnet_geterror(pnet));
-  
-  if( libnet_build_ethernet( target_hardware, source_hardware, ETHERTYPE_ARP, NULL, 0, pnet, 0 ) == -1 )
-    ERRLN("error building ethernet packet : %s\n", libnet_geterror( pnet ));
-  
-
-  retval = libnet_write( pnet );
-  if( retval == -1 )
-    ERRLN( "error sending packet : %s\n", libnet_geterror( pnet ) );
-  
-  libnet_clear_packet( pnet );
-
-  return retval;
+  return -1;
 }
 
-
-#define PROMISC 1
-
-struct pcap_loop_args {
-  mrb_value *ret;
-  mrb_state *mrb;
-  libnet_t  *ctx;
-};
-
 //
 // return 1 if the two mac targets are identical
 //
@@ -98,101 +207,539 @@ static int same_ether(const uint8_t *mac1, const uint8_t *mac2)
           (mac1[5] == mac2[5]);
 }
 
-static void pcap_packet_handler(uint8_t *args_ptr, const struct pcap_pkthdr *h, const uint8_t *bytes)
+// record when the sender of this reply answered, nothing is allocated here
+static void handle_reply(struct arp_state *st, const uint8_t *bytes, uint32_t len, const struct timespec *received_at)
 {
-  uint32_t                     ip;
-  uint8_t                     *ether_src;
-  struct libnet_ethernet_hdr  *heth;
-  struct libnet_arp_hdr       *harp;
-  struct pcap_loop_args       *args = (struct pcap_loop_args *)args_ptr;
-  struct libnet_ether_addr    *myaddr;
-  char                        *host;
-  mrb_value                   key;
+  const struct arp_frame *reply = (const struct arp_frame *) bytes;
+  struct arp_probe *probe;
+  in_addr_t ip;
+  int64_t idx;
   
-  heth = (void*) bytes;
-  harp = (void*)((char*)heth + LIBNET_ETH_H);
+  if( (len < sizeof(struct arp_frame)) || (st->targets_count == 0) )
+    return;
   
-  ether_src = (uint8_t*)harp + LIBNET_ARP_H;
+  // check packet type and source (ignore packet from us)
+  if( (ntohs(reply->eth.ether_type) != ETHERTYPE_ARP) || (ntohs(reply->arp.ar_op) != ARPOP_REPLY) )
+    return;
   
-  myaddr = libnet_get_hwaddr(args->ctx);
+  if( same_ether(reply->sender_hw, st->hwaddr.ether_addr_octet) )
+    return;
   
-  // check packet type and source (ignore packet from us)
-  if( (ntohs(heth->ether_type) == ETHERTYPE_ARP) && (ntohs(harp->ar_op) == ARPOP_REPLY) ){
-    // printf("arp from %02x:%02x:%02x:%02x:%02x:%02x\n",
-    //     ether_src[0], ether_src[1], ether_src[2], ether_src[3], ether_src[4], ether_src[5]
-    //   );
-    
-    if( !same_ether(ether_src, myaddr->ether_addr_octet) ){
-      // printf("ip: %s, target: %s ? %d\n", inet_ntoa( *((struct in_addr *) &ip) ), target_address, strcmp( inet_ntoa( *((struct in_addr *) &ip) ), target_address) );
-      // memcpy(&ip, (char*)harp + LIBNET_ARP_H + (harp->ar_hln * 2) + harp->ar_pln, 4);
-      memcpy(&ip, (char*)harp + LIBNET_ARP_H + harp->ar_hln, 4);
-      host = inet_ntoa( *((struct in_addr *) &ip));
-      
-      key = mrb_str_new_cstr(args->mrb, host);
-      mrb_hash_set(args->mrb, *args->ret, key, mrb_true_value());
+  memcpy(&ip, reply->sender_ip, 4);
+  
+  idx = find_target(st, ip);
+  if( idx == -1 )
+    return;
+  
+  // arp replies carry nothing telling which request they answer, they
+  // are matched with the last one sent and the duplicates are ignored
+  probe = &st->probes[st->round * st->targets_count + idx];
+  if( !timespec_isset(&probe->sent_at) || timespec_isset(&probe->received_at) )
+    return;
+  
+  probe->received_at = *received_at;
+  st->received++;
+  
+  memcpy(st->neighbors[idx].mac, reply->sender_hw, 6);
+}
+
+#ifdef HAVE_PACKET_RING
+
+// open a packet socket only receiving the arp replies sent to our mac
+// and ip address and map its receive ring
+static int open_ring(struct arp_state *st, const char *ifname)
+{
+  const uint8_t *mac = st->hwaddr.ether_addr_octet;
+  int version = TPACKET_V3;
+  struct tpacket_req3 req;
+  struct sockaddr_ll addr;
+  struct sock_fprog prog;
+  struct sock_filter code[] = {
+    BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),                         // ethernet type
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETHERTYPE_ARP, 0, 9),
+    BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 20),                         // arp operation
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ARPOP_REPLY, 0, 7),
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 0),                          // ethernet destination
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ((uint32_t) mac[0] << 24) | (mac[1] << 16) | (mac[2] << 8) | mac[3], 0, 5),
+    BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 4),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (mac[4] << 8) | mac[5], 0, 3),
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 38),                         // arp target ip
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohl(st->ip_source), 0, 1),
+    BPF_STMT(BPF_RET | BPF_K, REPLY_SNAPLEN),                       // accept
+    BPF_STMT(BPF_RET | BPF_K, 0)                                    // drop
+  };
+  
+  // no protocol until bind() so nothing is queued before the filter is set
+  st->ring_fd = socket(AF_PACKET, SOCK_RAW, 0);
+  if( st->ring_fd == -1 )
+    return -1;
+  
+  prog.len = sizeof(code) / sizeof(code[0]);
+  prog.filter = code;
+  
+  if( setsockopt(st->ring_fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) == -1 )
+    return -1;
+  
+  if( setsockopt(st->ring_fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1 )
+    return -1;
+  
+  bzero(&req, sizeof(req));
+  req.tp_block_size = RING_BLOCK_SIZE;
+  req.tp_block_nr = RING_BLOCK_COUNT;
+  req.tp_frame_size = RING_FRAME_SIZE;
+  req.tp_frame_nr = (RING_BLOCK_SIZE / RING_FRAME_SIZE) * RING_BLOCK_COUNT;
+  req.tp_retire_blk_tov = RING_BLOCK_TIMEOUT;
+  
+  if( setsockopt(st->ring_fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) == -1 )
+    return -1;
+  
+  st->ring = mmap(NULL, RING_BLOCK_SIZE * RING_BLOCK_COUNT, PROT_READ | PROT_WRITE, MAP_SHARED, st->ring_fd, 0);
+  if( st->ring == MAP_FAILED ){
+    st->ring = NULL;
+    return -1;
+  }
+  
+  st->ring_block = 0;
+  
+  bzero(&addr, sizeof(addr));
+  addr.sll_family = AF_PACKET;
+  addr.sll_protocol = htons(ETHERTYPE_ARP);
+  addr.sll_ifindex = if_nametoindex(ifname);
+  
+  if( bind(st->ring_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 )
+    return -1;
+  
+  return 0;
+}
+
+// walk the blocks the kernel gave back to us and return them, the
+// packets are read in place
+static void read_ring(struct arp_state *st, int keep)
+{
+  while(1){
+    struct tpacket_block_desc *block = (struct tpacket_block_desc *)(st->ring + st->ring_block * RING_BLOCK_SIZE);
+    struct tpacket3_hdr *pkt;
+    uint32_t i;
+    
+    if( (block->hdr.bh1.block_status & TP_STATUS_USER) == 0 )
+      break;
+    
+    __sync_synchronize();
+    
+    if( keep ){
+      pkt = (struct tpacket3_hdr *)((uint8_t *)block + block->hdr.bh1.offset_to_first_pkt);
+      for(i = 0; i< block->hdr.bh1.num_pkts; i++){
+        struct timespec received_at = { pkt->tp_sec, pkt->tp_nsec };
+        
+        handle_reply(st, (uint8_t *)pkt + pkt->tp_mac, pkt->tp_snaplen, &received_at);
+        pkt = (struct tpacket3_hdr *)((uint8_t *)pkt + pkt->tp_next_offset);
+      }
     }
     
+    __sync_synchronize();
+    block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+    
+    st->ring_block = (st->ring_block + 1) % RING_BLOCK_COUNT;
   }
+}
+
+#ifdef HAVE_SIMULATOR
+
+// read the replies of the simulated network, they come without
+// timestamp so the time they are read is used
+static void read_simulated(struct arp_state *st, int keep)
+{
+  uint8_t frame[REPLY_SNAPLEN];
+  struct timespec received_at;
+  ssize_t len;
   
+  while( (len = recv(st->sim_recv_fd, frame, sizeof(frame), MSG_DONTWAIT)) > 0 ){
+    if( keep ){
+      clock_gettime(CLOCK_REALTIME, &received_at);
+      handle_reply(st, frame, len, &received_at);
+    }
+  }
 }
 
-#define PCAP_FILTER "arp"
+#endif
+
+#else
 
-static mrb_value send_and_receive_replies(mrb_state *mrb, mrb_value self, const struct arp_state *st, mrb_int timeout)
+// how long pcap can buffer packets before handing them to us (ms)
+#define PCAP_BUFFER_TIMEOUT 10
+
+static void pcap_packet_handler(uint8_t *args_ptr, const struct pcap_pkthdr *h, const uint8_t *bytes)
 {
-  int i;
-  char errbuff[PCAP_ERRBUF_SIZE];
-  const char *ifname;
-  mrb_value ret_value;
-  struct pcap_loop_args loop_args;
+  struct timespec received_at = { h->ts.tv_sec, h->ts.tv_usec * 1000 };
+  
+  handle_reply((struct arp_state *)args_ptr, bytes, h->caplen, &received_at);
+}
+
+static void pcap_discard_handler(uint8_t *args_ptr, const struct pcap_pkthdr *h, const uint8_t *bytes)
+{
+  
+}
+
+// open the capture handle used for the whole life of the pinger, it is
+// not promiscuous and the kernel only passes arp replies sent to our
+// mac and ip address
+static pcap_t *open_capture(const char *ifname, const struct libnet_ether_addr *hwaddr, in_addr_t ip, char *errbuff)
+{
+  pcap_t *p;
   struct bpf_program arp_p;
-  struct timeval sent_at, received_at;
-  double elapsed;
+  char filter[128];
+  const uint8_t *mac = hwaddr->ether_addr_octet;
   
-  gettimeofday(&sent_at, NULL);
+  p = pcap_create(ifname, errbuff);
+  if( p == NULL )
+    return NULL;
   
-  ifname = libnet_getdevice(st->ctx);
+  pcap_set_snaplen(p, REPLY_SNAPLEN);
+  pcap_set_promisc(p, 0);
+  pcap_set_timeout(p, PCAP_BUFFER_TIMEOUT);
+  pcap_set_immediate_mode(p, 1);
   
-  pcap = pcap_open_live(ifname, 2048, PROMISC, timeout, errbuff);
-  if( pcap == NULL )
-    ERRF("pcap_open_live failed: %s\n", errbuff);
+  if( pcap_activate(p) < 0 ){
+    snprintf(errbuff, PCAP_ERRBUF_SIZE, "pcap_activate(): %s", pcap_geterr(p));
+    pcap_close(p);
+    return NULL;
+  }
   
-  // if( strlen(errbuff) > 0 ) WARN("warning: %s\n", errbuff);
+  // arp[6:2] is the operation and arp[24:4] the target protocol address
+  snprintf(filter, sizeof(filter), "arp and arp[6:2] = 2 and ether dst %02x:%02x:%02x:%02x:%02x:%02x and arp[24:4] = 0x%08x",
+      mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], ntohl(ip)
+    );
   
-  /* compile pcap filter */
-  if( pcap_compile(pcap, &arp_p, PCAP_FILTER, 0, 0) == -1 )
-    ERRF("pcap_compile(): %s\n", pcap_geterr(pcap));
+  if( pcap_compile(p, &arp_p, filter, 1, PCAP_NETMASK_UNKNOWN) == -1 ){
+    snprintf(errbuff, PCAP_ERRBUF_SIZE, "pcap_compile(): %s", pcap_geterr(p));
+    pcap_close(p);
+    return NULL;
+  }
   
-  if( pcap_setfilter(pcap, &arp_p) == -1 )
-    ERRF("pcap_setfilter(): %s\n", pcap_geterr(pcap));
+  if( pcap_setfilter(p, &arp_p) == -1 ){
+    snprintf(errbuff, PCAP_ERRBUF_SIZE, "pcap_setfilter(): %s", pcap_geterr(p));
+    pcap_freecode(&arp_p);
+    pcap_close(p);
+    return NULL;
+  }
   
-  // if( get_hw_addr(ifname, hwaddr) != 0 )
-  //   ERR("Unable to get MAC address for %s\n", ifname);
+  pcap_freecode(&arp_p);
   
-  loop_args.ctx = st->ctx;
-  loop_args.mrb = mrb;
-  loop_args.ret = &ret_value;
+  // we wait with poll() ourselves
+  if( pcap_setnonblock(p, 1, errbuff) == -1 ){
+    pcap_close(p);
+    return NULL;
+  }
   
-  ret_value = mrb_hash_new_capa(mrb, st->targets_count);
+  return p;
+}
+
+#endif
+
+static void reset_probes(mrb_state *mrb, struct arp_state *st, uint16_t rows)
+{
+  uint32_t needed = rows * st->targets_count;
   
-  // send all arp requests
-  for(i = 0; i< st->targets_count; i++){
-    arp_send(st->ctx, ARPOP_REQUEST, NULL, st->ip_source, NULL, st->targets[i].in_addr);
+  if( needed > st->probes_capacity ){
+    st->probes = mrb_realloc(mrb, st->probes, needed * sizeof(struct arp_probe));
+    st->probes_capacity = needed;
   }
   
+  if( rows > st->samples_capacity ){
+    st->samples = mrb_realloc(mrb, st->samples, rows * sizeof(mrb_int));
+    st->samples_capacity = rows;
+  }
+  
+  if( needed > 0 )
+    bzero(st->probes, needed * sizeof(struct arp_probe));
+  
+  st->round = 0;
+  st->sent = 0;
+  st->received = 0;
+}
+
+// handle the replies already received, never blocks
+static void read_replies(mrb_state *mrb, struct arp_state *st)
+{
+#ifdef HAVE_SIMULATOR
+  if( st->sim != NULL ){
+    read_simulated(st, 1);
+    return;
+  }
+#endif
+  
+#ifdef HAVE_PACKET_RING
+  read_ring(st, 1);
+#else
+  if( pcap_dispatch(st->pcap, -1, pcap_packet_handler, (uint8_t *)st) == -1 ){
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "pcap_dispatch(): %S", mrb_str_new_cstr(mrb, pcap_geterr(st->pcap)));
+  }
+#endif
+}
+
+// read the replies until the given time, when all is set return as soon
+// as every request sent got its reply
+static void receive_replies(mrb_state *mrb, struct arp_state *st, const struct timespec *until, int all)
+{
+  struct timespec now;
+  struct pollfd pfd;
+  mrb_int remaining;
+  
+#ifdef HAVE_PACKET_RING
+  pfd.fd = st->ring_fd;
+#else
+  pfd.fd = pcap_get_selectable_fd(st->pcap);
+#endif
+#ifdef HAVE_SIMULATOR
+  if( st->sim != NULL )
+    pfd.fd = st->sim_recv_fd;
+#endif
+  pfd.events = POLLIN;
+  
   while(1){
-    if( pcap_dispatch(pcap, 0, pcap_packet_handler, (uint8_t *)&loop_args) == -1 ){
-      ERRF("pcap_loop(): %s\n", pcap_geterr(pcap));
-    }
+    read_replies(mrb, st);
+    
+    if( all && (st->received >= st->sent) )
+      break;
     
-    gettimeofday(&received_at, NULL);
-    elapsed = ((received_at.tv_sec - sent_at.tv_sec) * 1000 + floor((received_at.tv_usec - sent_at.tv_usec) / 1000));
-    if( elapsed >= timeout )
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    remaining = timediff(&now, until);
+    if( remaining <= 0 )
       break;
     
+    // round up to the next ms, poll() would return too early
+    if( (poll(&pfd, 1, (remaining + 999) / 1000) == -1) && (errno != EINTR) ){
+      mrb_raisef(mrb, E_RUNTIME_ERROR, "poll(): %S", mrb_str_new_cstr(mrb, strerror(errno)));
+    }
+  }
+}
+
+// fill the frame of the arp request asking who has target
+static void build_request(const struct arp_state *st, in_addr_t target, uint8_t *frame)
+{
+  struct arp_frame *req = (struct arp_frame *) frame;
+  
+  memset(req->eth.ether_dhost, 0xff, 6);
+  memcpy(req->eth.ether_shost, st->hwaddr.ether_addr_octet, 6);
+  req->eth.ether_type = htons(ETHERTYPE_ARP);
+  
+  req->arp.ar_hrd = htons(ARPHRD_ETHER);
+  req->arp.ar_pro = htons(ETHERTYPE_IP);
+  req->arp.ar_hln = 6;
+  req->arp.ar_pln = 4;
+  req->arp.ar_op = htons(ARPOP_REQUEST);
+  
+  memcpy(req->sender_hw, st->hwaddr.ether_addr_octet, 6);
+  memcpy(req->sender_ip, &st->ip_source, 4);
+  memset(req->target_hw, 0xff, 6);
+  memcpy(req->target_ip, &target, 4);
+}
+
+// send the prebuilt requests of the n targets in batch and record
+// when they left, a request which could not be sent is lost
+static void send_frames(struct arp_state *st, struct arp_probe *row, const uint32_t *batch, uint32_t n)
+{
+  struct timespec sent_at;
+  uint32_t i;
+#ifdef HAVE_SENDMMSG
+  struct mmsghdr msgs[SEND_BATCH_SIZE];
+  struct iovec iovecs[SEND_BATCH_SIZE];
+  uint32_t sent = 0;
+  int ret, sock = st->ring_fd;
+  
+#ifdef HAVE_SIMULATOR
+  if( st->sim != NULL )
+    sock = st->sim_send_fd;
+#endif
+  
+  // the socket is bound to the interface (or connected to the simulated
+  // network), no address needed
+  for(i = 0; i< n; i++){
+    iovecs[i].iov_base = st->frames + batch[i] * ARP_FRAME_SIZE;
+    iovecs[i].iov_len = ARP_FRAME_SIZE;
+    
+    bzero(&msgs[i].msg_hdr, sizeof(msgs[i].msg_hdr));
+    msgs[i].msg_hdr.msg_iov = &iovecs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  
+  while( sent < n ){
+    ret = sendmmsg(sock, &msgs[sent], n - sent, 0);
+    if( ret == -1 ){
+      if( errno == EINTR )
+        continue;
+      
+      // skip the packet which failed and send the others
+      perror("sendmmsg");
+      sent++;
+      continue;
+    }
+    
+    // same clock as the capture timestamps
+    clock_gettime(CLOCK_REALTIME, &sent_at);
+    for(i = sent; i< sent + ret; i++){
+      row[batch[i]].sent_at = sent_at;
+    }
+    
+    st->sent += ret;
+    sent += ret;
   }
+#else
+  for(i = 0; i< n; i++){
+    if( libnet_write_link(st->ctx, st->frames + batch[i] * ARP_FRAME_SIZE, ARP_FRAME_SIZE) == -1 ){
+      printf("error sending packet : %s\n", libnet_geterror(st->ctx));
+      continue;
+    }
+    
+    // same clock as the capture timestamps
+    clock_gettime(CLOCK_REALTIME, &sent_at);
+    row[batch[i]].sent_at = sent_at;
+    st->sent++;
+  }
+#endif
+}
+
+// return 1 if the target answered recently enough to trust the cache
+static int neighbor_is_fresh(const struct arp_state *st, uint32_t target)
+{
+  const struct neighbor *n = &st->neighbors[target];
+  
+  return (st->cache_ttl > 0) && timespec_isset(&n->seen_at) && (timespec_cmp(&n->seen_at, &st->fresh_after) >= 0);
+}
+
+// send one arp request to each target not fresh in the cache, with max_pps
+// the requests are spread and the replies are read while waiting
+static void send_round(mrb_state *mrb, struct arp_state *st, struct arp_probe *row)
+{
+  uint64_t gap = (st->max_pps > 0) ? 1000000000 / st->max_pps : 0;
+  uint32_t batch[SEND_BATCH_SIZE];
+  struct timespec next, now;
+  uint32_t n = 0;
   
-  pcap_close(pcap);
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  
+  while( n < st->targets_count ){
+    uint32_t count = 0;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if( timespec_cmp(&next, &now) > 0 ){
+      receive_replies(mrb, st, &next, 0);
+      clock_gettime(CLOCK_MONOTONIC, &now);
+    }
+    
+    // every request already due goes in the batch
+    while( (n < st->targets_count) && (count < SEND_BATCH_SIZE) && (timespec_cmp(&next, &now) <= 0) ){
+      uint32_t target = n++;
+      
+      if( neighbor_is_fresh(st, target) )
+        continue;
+      
+      timespec_add_nsec(&next, gap);
+      batch[count++] = target;
+    }
+    
+    if( count > 0 )
+      send_frames(st, row, batch, count);
+    
+    // do not let the replies pile up in the ring during a large sweep
+    read_replies(mrb, st);
+  }
+}
+
+static mrb_value send_and_receive_replies(mrb_state *mrb, struct arp_state *st, mrb_int timeout, uint16_t count, mrb_int delay, mrb_value percentiles)
+{
+  int i, ai;
+  uint16_t j;
+  mrb_value ret_value;
+  struct timespec started_at, deadline;
+  
+  reset_probes(mrb, st, count);
+  
+  // drop the late replies of the previous cycle
+#ifdef HAVE_SIMULATOR
+  if( st->sim != NULL )
+    read_simulated(st, 0);
+  else
+#endif
+#ifdef HAVE_PACKET_RING
+  read_ring(st, 0);
+#else
+  while( pcap_dispatch(st->pcap, -1, pcap_discard_handler, NULL) > 0 )
+    ;
+#endif
+  
+  // the cache entries are only refreshed once the call ends, the
+  // same targets are skipped for all the rounds
+  clock_gettime(CLOCK_REALTIME, &st->fresh_after);
+  st->fresh_after.tv_sec -= st->cache_ttl / 1000;
+  st->fresh_after.tv_nsec -= (st->cache_ttl % 1000) * 1000000;
+  if( st->fresh_after.tv_nsec < 0 ){
+    st->fresh_after.tv_nsec += 1000000000;
+    st->fresh_after.tv_sec -= 1;
+  }
+  
+  clock_gettime(CLOCK_MONOTONIC, &started_at);
+  deadline = started_at;
+  timespec_add_usec(&deadline, timeout * 1000);
+  
+  for(j = 0; j< count; j++){
+    struct timespec round_start = started_at;
+    
+    // the replies to the previous round are read until this one starts
+    timespec_add_usec(&round_start, j * delay * 1000);
+    if( j > 0 )
+      receive_replies(mrb, st, &round_start, 0);
+    
+    st->round = j;
+    send_round(mrb, st, &st->probes[j * st->targets_count]);
+  }
+  
+  // no need to wait for the timeout once every request got its reply
+  receive_replies(mrb, st, &deadline, 1);
+  
+  // build the result once everything is received
+  ret_value = mrb_hash_new_capa(mrb, st->targets_count);
+  ai = mrb_gc_arena_save(mrb);
+  
+  for(i = 0; i< st->targets_count; i++){
+    struct latency_stats stats;
+    mrb_value key;
+    
+    // an address given twice only has its replies on the first one
+    if( find_target(st, st->targets[i].in_addr) != i )
+      continue;
+    
+    latency_stats_reset(&stats);
+    
+    if( neighbor_is_fresh(st, i) ){
+      // not asked this time, the last known latency stands for this call
+      st->samples[0] = st->neighbors[i].rtt;
+      latency_stats_add(&stats, st->neighbors[i].rtt);
+    }
+    else {
+      for(j = 0; j< count; j++){
+        struct arp_probe *probe = &st->probes[j * st->targets_count + i];
+        mrb_int rtt = -1;
+        
+        if( timespec_isset(&probe->sent_at) && timespec_isset(&probe->received_at) ){
+          rtt = timediff(&probe->sent_at, &probe->received_at);
+          if( rtt < 0 )
+            rtt = 0;
+          
+          st->samples[stats.received] = rtt;
+          
+          st->neighbors[i].seen_at = probe->received_at;
+          st->neighbors[i].rtt = rtt;
+        }
+        
+        latency_stats_add(&stats, rtt);
+      }
+    }
+    
+    key = mrb_str_new_cstr(mrb, inet_ntoa( *((struct in_addr *) &st->targets[i].in_addr) ));
+    mrb_hash_set(mrb, ret_value, key, latency_stats_value(mrb, &stats, st->samples, percentiles));
+    mrb_gc_arena_restore(mrb, ai);
+  }
   
   return ret_value;
 }
@@ -204,11 +751,52 @@ static mrb_value send_and_receive_replies(mrb_state *mrb, mrb_value self, const
 
 static mrb_value ping_initialize(mrb_state *mrb, mrb_value self)
 {
-  struct arp_state *st = mrb_malloc(mrb, sizeof(struct arp_state));
+  struct arp_state *st;
   char error_buffer[LIBNET_ERRBUF_SIZE];
+#ifndef HAVE_PACKET_RING
+  char pcap_error_buffer[PCAP_ERRBUF_SIZE];
+#endif
+  struct libnet_ether_addr *hwaddr;
   const char *ifname, *ip_source = NULL;
+  mrb_value simulation = mrb_nil_value();
+  
+  mrb_get_args(mrb, "z|zo", &ifname, &ip_source, &simulation);
+  
+  st = mrb_malloc(mrb, sizeof(struct arp_state));
+  bzero(st, sizeof(struct arp_state));
+#ifdef HAVE_PACKET_RING
+  st->ring_fd = -1;
+#endif
+  
+  // attached right away so the errors below leave the cleanup to the gc
+  DATA_PTR(self)  = (void*)st;
+  DATA_TYPE(self) = &arp_ping_state_type;
   
-  mrb_get_args(mrb, "z|z", &ifname, &ip_source);
+  if( !mrb_nil_p(simulation) ){
+#ifdef HAVE_SIMULATOR
+    struct simulator_config config;
+    const uint8_t mac[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+    
+    if( ip_source == NULL ){
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "the simulated backend needs a source address");
+    }
+    
+    parse_simulator_config(mrb, simulation, &config);
+    config.arp = 1;
+    
+    // no interface, a locally administered address stands for ours
+    memcpy(st->hwaddr.ether_addr_octet, mac, 6);
+    st->ip_source = inet_addr(ip_source);
+    
+    st->sim = simulator_start(&config, 0, &st->sim_send_fd, &st->sim_recv_fd);
+    if( st->sim == NULL )
+      ERR("cannot start the simulated network");
+    
+    return self;
+#else
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "the simulated backend is not supported on this platform");
+#endif
+  }
   
   st->ctx = libnet_init(LIBNET_LINK, ifname, error_buffer);
   if( st->ctx == NULL )
@@ -216,6 +804,15 @@ static mrb_value ping_initialize(mrb_state *mrb, mrb_value self)
   
   st->targets = NULL;
   
+  // our mac address does not change, no need to ask for it for each packet
+  hwaddr = libnet_get_hwaddr(st->ctx);
+  if( hwaddr == NULL ){
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "error obtaining source hardware address : %S\n", mrb_str_new_cstr(mrb, libnet_geterror( st->ctx )));
+    goto ret;
+  }
+  
+  memcpy(&st->hwaddr, hwaddr, sizeof(st->hwaddr));
+  
   if( ip_source != NULL ){
     st->ip_source = inet_addr(ip_source);
   }
@@ -228,8 +825,18 @@ static mrb_value ping_initialize(mrb_state *mrb, mrb_value self)
     
   }
   
-  DATA_PTR(self)  = (void*)st;
-  DATA_TYPE(self) = &arp_ping_state_type;
+#ifdef HAVE_PACKET_RING
+  if( open_ring(st, ifname) == -1 ){
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "cannot open packet ring: %S", mrb_str_new_cstr(mrb, strerror(errno)));
+    goto ret;
+  }
+#else
+  st->pcap = open_capture(ifname, &st->hwaddr, st->ip_source, pcap_error_buffer);
+  if( st->pcap == NULL ){
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "cannot open capture: %S", mrb_str_new_cstr(mrb, pcap_error_buffer));
+    goto ret;
+  }
+#endif
 
 ret:
   return self;
@@ -239,34 +846,204 @@ static mrb_value ping_set_targets(mrb_state *mrb, mrb_value self)
 {
   mrb_value arr;
   struct arp_state *st = DATA_PTR(self);
+  uint32_t i, count, lookup_size = 16;
+  struct target_address *old_targets = st->targets;
+  struct neighbor *old_neighbors = st->neighbors;
+  uint32_t old_count = st->targets_count;
+  int ai = mrb_gc_arena_save(mrb);
   
   mrb_get_args(mrb, "A", &arr);
   
-  if( st->targets != NULL ){
-    mrb_free(mrb, st->targets);
+  count = RARRAY_LEN(arr);
+  
+  // check the addresses before touching the state, the tables below
+  // must keep matching targets_count if we raise
+  for(i = 0; i< count; i++){
+    mrb_value obj = mrb_ary_ref(mrb, arr, i);
+    
+    if( !mrb_string_p(obj) )
+      mrb_raisef(mrb, E_TYPE_ERROR, "can't convert %s into String", mrb_obj_classname(mrb, obj));
+    
+    // raises if the string contains a null byte
+    mrb_str_to_cstr(mrb, obj);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  
+  // the strings were checked, the new table replaces the old one once filled
+  {
+    struct target_address *targets = mrb_malloc(mrb, sizeof(struct target_address) * (count + 1));
+    
+    ping_set_targets_common(mrb, arr, &count, targets);
+    
+    st->targets = targets;
+    st->targets_count = count;
+  }
+  
+  // keep the lookup table at most half full
+  while( lookup_size < 2 * st->targets_count )
+    lookup_size <<= 1;
+  
+  // the requests never change, build them once
+  st->frames = mrb_realloc(mrb, st->frames, st->targets_count * ARP_FRAME_SIZE);
+  for(i = 0; i< st->targets_count; i++){
+    build_request(st, st->targets[i].in_addr, st->frames + i * ARP_FRAME_SIZE);
+  }
+  
+  st->lookup_mask = lookup_size - 1;
+  st->lookup = mrb_realloc(mrb, st->lookup, sizeof(uint32_t) * lookup_size);
+  bzero(st->lookup, sizeof(uint32_t) * lookup_size);
+  
+  for(i = 0; i< st->targets_count; i++){
+    uint32_t slot = target_hash(st->targets[i].in_addr) & st->lookup_mask;
+    
+    while( st->lookup[slot] != 0 ){
+      // the same address given twice
+      if( st->targets[st->lookup[slot] - 1].in_addr == st->targets[i].in_addr )
+        break;
+      
+      slot = (slot + 1) & st->lookup_mask;
+    }
+    
+    if( st->lookup[slot] == 0 )
+      st->lookup[slot] = i + 1;
+  }
+  
+  // the addresses still there keep what we know about them
+  st->neighbors = mrb_malloc(mrb, sizeof(struct neighbor) * (st->targets_count + 1));
+  bzero(st->neighbors, sizeof(struct neighbor) * (st->targets_count + 1));
+  
+  for(i = 0; i< old_count; i++){
+    int64_t idx;
+    
+    if( !timespec_isset(&old_neighbors[i].seen_at) )
+      continue;
+    
+    idx = find_target(st, old_targets[i].in_addr);
+    if( idx != -1 )
+      st->neighbors[idx] = old_neighbors[i];
   }
   
-  st->targets_count = RARRAY_LEN(arr);
-  st->targets = mrb_malloc(mrb, sizeof(struct target_address) * st->targets_count );
+#ifdef HAVE_SIMULATOR
+  // room for two rounds in the simulated network
+  if( st->sim != NULL )
+    simulator_set_queue(st->sim, 2 * st->targets_count);
+#endif
   
-  ping_set_targets_common(mrb, arr, &st->targets_count, st->targets);
+  if( old_targets != NULL )
+    mrb_free(mrb, old_targets);
+  
+  if( old_neighbors != NULL )
+    mrb_free(mrb, old_neighbors);
   
   return self;
 }
 
 
+// send_pings(timeout, count = 1, delay = 50, percentiles = nil)
+// 
+// send count rounds of arp requests delay ms apart and wait up to timeout ms
+// for the replies, return {ip => [average, loss percentage, {percentile => latency},
+// min, max, stddev, jitter]} for each target, latencies are in usec
+// 
+// the targets which answered less than cache_ttl ms ago are not asked
+// again, their last latency is reported as a single reply
 static mrb_value ping_send_pings(mrb_state *mrb, mrb_value self)
 {
-  mrb_int timeout;
+  mrb_int timeout, count = 1, delay = 50;
+  mrb_value percentiles = mrb_nil_value();
+  struct arp_state *st = DATA_PTR(self);
+  
+  mrb_get_args(mrb, "i|iiA", &timeout, &count, &delay, &percentiles);
+  
+  if( timeout <= 0 ) {
+    mrb_raisef(mrb, E_TYPE_ERROR, "timeout should be positive and non null: %S", mrb_fixnum_value(timeout));
+  }
+  
+  if( (count <= 0) || (count > 0xffff) ){
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "count should be between 1 and 65535: %S", mrb_fixnum_value(count));
+  }
+  
+  if( (delay < 0) || (delay * (count - 1) >= timeout) ){
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "the last round should start before the timeout: delay * (count - 1) < timeout");
+  }
+  
+  if( (uint64_t) count * st->targets_count > UINT32_MAX ){
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "too many requests for one call, lower the count");
+  }
+  
+  return send_and_receive_replies(mrb, st, timeout, count, delay, percentiles);
+}
+
+
+static mrb_value ping_set_cache_ttl(mrb_state *mrb, mrb_value self)
+{
+  struct arp_state *st = DATA_PTR(self);
+  mrb_int ttl;
+  
+  mrb_get_args(mrb, "i", &ttl);
+  
+  if( ttl < 0 ){
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "cache_ttl should be positive");
+  }
+  
+  st->cache_ttl = ttl;
+  
+  return self;
+}
+
+// return {ip => [mac, age, latency]} for each target which ever answered,
+// the age of the last reply is in ms and its latency in usec
+static mrb_value ping_neighbors(mrb_state *mrb, mrb_value self)
+{
   struct arp_state *st = DATA_PTR(self);
+  mrb_value ret_value = mrb_hash_new(mrb);
+  struct timespec now;
+  uint32_t i;
+  int ai;
   
-  mrb_get_args(mrb, "i", &timeout);
+  clock_gettime(CLOCK_REALTIME, &now);
+  ai = mrb_gc_arena_save(mrb);
   
-  // and collect the replies
+  for(i = 0; i< st->targets_count; i++){
+    const struct neighbor *n = &st->neighbors[i];
+    mrb_value entry, key;
+    char mac[18];
+    
+    if( !timespec_isset(&n->seen_at) || (find_target(st, st->targets[i].in_addr) != i) )
+      continue;
+    
+    snprintf(mac, sizeof(mac), "%02x:%02x:%02x:%02x:%02x:%02x",
+        n->mac[0], n->mac[1], n->mac[2], n->mac[3], n->mac[4], n->mac[5]
+      );
+    
+    entry = mrb_ary_new_capa(mrb, 3);
+    mrb_ary_push(mrb, entry, mrb_str_new_cstr(mrb, mac));
+    mrb_ary_push(mrb, entry, mrb_fixnum_value(timediff(&n->seen_at, &now) / 1000));
+    mrb_ary_push(mrb, entry, mrb_fixnum_value(n->rtt));
+    
+    key = mrb_str_new_cstr(mrb, inet_ntoa( *((struct in_addr *) &st->targets[i].in_addr) ));
+    mrb_hash_set(mrb, ret_value, key, entry);
+    mrb_gc_arena_restore(mrb, ai);
+  }
   
-  return send_and_receive_replies(mrb, self, st, timeout);
+  return ret_value;
 }
 
+static mrb_value ping_set_max_pps(mrb_state *mrb, mrb_value self)
+{
+  struct arp_state *st = DATA_PTR(self);
+  mrb_int pps;
+  
+  mrb_get_args(mrb, "i", &pps);
+  
+  if( pps < 0 ){
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "max_pps should be positive");
+  }
+  
+  st->max_pps = pps;
+  
+  return self;
+}
 
 void mruby_ping_init_arp(mrb_state *mrb)
 {
@@ -274,9 +1051,12 @@ void mruby_ping_init_arp(mrb_state *mrb)
   
   int ai = mrb_gc_arena_save(mrb);
   
-  mrb_define_method(mrb, class, "initialize", ping_initialize,  MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, class, "initialize", ping_initialize,  MRB_ARGS_REQ(1) | MRB_ARGS_OPT(2));
   mrb_define_method(mrb, class, "set_targets", ping_set_targets,  MRB_ARGS_REQ(1));
-  mrb_define_method(mrb, class, "send_pings", ping_send_pings,  MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, class, "send_pings", ping_send_pings,  MRB_ARGS_REQ(1) | MRB_ARGS_OPT(3));
+  mrb_define_method(mrb, class, "max_pps=", ping_set_max_pps,  MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, class, "cache_ttl=", ping_set_cache_ttl,  MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, class, "neighbors", ping_neighbors,  MRB_ARGS_NONE());
     
   mrb_gc_arena_restore(mrb, ai);
 }
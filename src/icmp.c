@@ -1,3 +1,6 @@
+// recvmmsg/sendmmsg (glibc)
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
@@ -14,10 +17,76 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <time.h>
 
 #include <unistd.h>
 #include <strings.h> // bzero
 
+#ifdef __linux__
+#define HAVE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+// how many events we handle for each epoll_wait call
+#define EPOLL_MAX_EVENTS 64
+
+#define HAVE_RECVMMSG
+// how many packets we read with each recvmmsg call
+#define RECV_BATCH_SIZE 32
+
+#define HAVE_SENDMMSG
+// how many packets we send with each sendmmsg call
+#define SEND_BATCH_SIZE 64
+
+#define HAVE_SOCKET_FILTER
+#include <linux/filter.h>
+
+// unprivileged icmp sockets (SOCK_DGRAM), the kernel builds the ip header,
+// sets the icmp id and only gives each socket the replies to its own id
+#define HAVE_PING_SOCKET
+
+// the kernel can timestamp the requests when the driver sends them and
+// queue a copy on the error queue of the socket (SO_TIMESTAMPING)
+#define HAVE_TX_TIMESTAMPS
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+
+// the copy holds the link, ip and icmp headers of the request
+#define TX_PACKET_SIZE 128
+
+// received packets carry SCM_TIMESTAMPNS and SO_RXQ_OVFL, and SCM_TIMESTAMPING
+// too when the send timestamps are enabled on the socket (no
+// SOF_TIMESTAMPING_OPT_RX_FILTER in older kernels)
+#define RECV_CONTROL_SIZE (CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(struct scm_timestamping)))
+#else
+// how often the select() receiver checks if it should stop (in usec)
+#define RECEIVER_POLL_INTERVAL 100000
+#endif
+
+// data carried by each echo request and sent back in the reply, all in
+// network byte order: the cookie is random for each pinger, the index
+// tells which target the reply comes from, round is the icmp sequence,
+// sent_* the time the request was sent (CLOCK_REALTIME) and tag a keyed
+// hash of all of them so a reply we did not ask for cannot pass as ours
+struct probe_payload {
+  uint32_t cookie;
+  uint32_t index;
+  uint32_t round;
+  uint32_t sent_sec;
+  uint32_t sent_nsec;
+  uint32_t tag;
+};
+
+// we only need the ip header (with options), the icmp echo header and our payload
+#define RECV_PACKET_SIZE (60 + LIBNET_ICMPV4_ECHO_H + sizeof(struct probe_payload))
+
+// maximum number of rounds in flight in continuous mode
+#define MONITOR_MAX_WINDOW 1024
+
+// maximum number of workers the targets can be sharded over
+#define MAX_WORKERS 64
+
 #define MALLOC(X) mrb_malloc(mrb, X);
 #define REALLOC(P, X) mrb_realloc(mrb, P, X);
 #define FREE(X) mrb_free(mrb, X);
@@ -27,11 +96,106 @@
 static char errbuf[LIBNET_ERRBUF_SIZE];
 
 struct capture_socket {
+  uint16_t  shard;          // worker receiving on this socket
   uint32_t  rtable;
+  in_addr_t in_addr_src;    // datagram sockets only, the socket is bound to it
 #ifdef SO_BINDTODEVICE
   char      device[IFNAMSIZ];
 #endif
   int socket;
+  uint32_t  drops;          // packets dropped by the kernel (SO_RXQ_OVFL)
+  uint32_t  refs;           // targets using this socket, closed when it drops to 0
+};
+
+// what the hot paths did, each worker has its own counters updated by its
+// sender and receiver threads, they are only summed when ICMPPinger#stats
+// is called so relaxed atomic additions are enough
+struct counters {
+  uint64_t built;           // echo requests built
+  uint64_t sent;
+  uint64_t send_errors;
+  uint64_t recv_calls;      // recvmmsg/recvfrom calls
+  uint64_t received;        // packets read from the capture sockets
+  uint64_t matched;         // echo replies matched with one of our requests
+  uint64_t unmatched;       // foreign packets, duplicates
+  uint64_t late;            // replies past the timeout or to an old round
+  uint64_t wakeups;         // epoll_wait/select returns in the receiver
+  uint64_t build_ns;
+  uint64_t send_ns;
+  uint64_t receive_ns;
+};
+
+#define COUNTER_ADD(C, NAME, N) __atomic_fetch_add(&(C)->NAME, (N), __ATOMIC_RELAXED)
+
+#ifdef HAVE_SENDMMSG
+// prebuilt echo request for one target, only the sequence number
+// and the icmp checksum change between rounds
+struct probe_template {
+  uint8_t             packet[LIBNET_IPV4_H + LIBNET_ICMPV4_ECHO_H + sizeof(struct probe_payload)];
+  struct sockaddr_in  dst;
+  int                 socket;
+};
+#endif
+
+// outcome of one request, the send time comes back in the reply payload
+// so only the latency is kept: the reply adds received - sent and the
+// kernel send timestamp, when enabled, removes the time the request
+// waited before leaving
+struct ping_reply {
+  uint16_t seq;
+  uint8_t  sent;
+  uint8_t  received;
+  int32_t  rtt;         // usec
+};
+
+// spread the requests of a round over time, each request has a deadline
+// on CLOCK_MONOTONIC and the deadlines are gap nanoseconds apart
+struct pacer {
+  struct timespec next;
+  uint64_t gap;
+  volatile int *running;    // if set, stop waiting when it becomes 0 (signaled by monitor_cond)
+};
+
+struct state;
+
+// target i belongs to the worker i % workers_count, each worker has its own
+// capture sockets and receiver thread and, when send_pings is used with
+// more than one worker, its own sender thread
+struct worker {
+  struct state *st;
+  uint16_t shard;
+  
+#ifdef HAVE_EPOLL
+  // capture sockets and the receiver wakeup event are registered once in this set
+  int epoll_fd;
+  int wakeup_fd;
+#endif
+  
+  // receiver thread, started on first use and running until the pinger is freed
+  pthread_t receiver;
+  int receiver_started;
+  volatile int receiver_stopping;
+  
+#ifdef HAVE_SENDMMSG
+  // the targets of this worker are send_order[send_start .. send_start + send_count[
+  uint32_t send_start;
+  uint32_t send_count;
+  pthread_t sender;
+  uint32_t sender_cycle;    // last cycle sent by the sender thread
+#endif
+  
+  // simulated backend, requests are written to sim_send_fd and the
+  // replies are read from sim_recv_fd
+  struct simulator *sim;
+  int sim_send_fd;
+  int sim_recv_fd;
+  
+  struct counters counters;
+  int control_truncated;    // MSG_CTRUNC already reported
+  
+  // held by the receiver while it updates the reply slots of its targets,
+  // the state lock is only taken to publish what was matched
+  pthread_mutex_t replies_lock;
 };
 
 struct state {
@@ -39,104 +203,576 @@ struct state {
   uint16_t capture_sockets_count;
   
   struct target_address *targets;
-  uint16_t targets_count;
+  uint32_t targets_count;
+  uint32_t targets_capacity;
+  uint32_t next_key;      // key of the next target added, 100 for the first one
+  
+  // use datagram icmp sockets instead of raw sockets and libnet, the
+  // capture sockets are then used for sending too
+  int dgram;
   
+  // replace the send time taken before sendmmsg() by the time the
+  // driver sent the request
+  int tx_timestamps;
+  
+  // no packet leaves the host, each worker talks to its own simulated
+  // network instead (see simulator.c)
+  int simulated;
+  struct simulator_config sim_config;
+  
+  // icmp id used for targets without uid and cookie sent in every request,
+  // both random so we do not collide with other pingers
+  uint16_t id_base;
+  uint32_t cookie;
+  
+  // key of the payload tag, never sent
+  uint64_t tag_key;
+  
+  // one per device, libnet_contexts_refs[i] targets use libnet_contexts[i]
   libnet_t **libnet_contexts;
+  uint32_t *libnet_contexts_refs;
   uint16_t libnet_contexts_count;
+  
+  struct worker *workers;
+  uint16_t workers_count;
+
+#ifdef HAVE_SENDMMSG
+  // one template per target (targets_capacity of them), send_order lists the
+  // targets grouped by worker and then by sending socket so each group can
+  // be sent in one call
+  struct probe_template *templates;
+  uint32_t *send_order;
+#endif
+  
+  // everything below is shared with the receivers and protected by this lock,
+  // except the reply slots and the monitoring stats which are updated under
+  // the replies_lock of the target's worker, the receivers only touch the
+  // targets and the replies while a cycle is active
+  pthread_mutex_t lock;
+  
+  // replies of the current cycle, window rows of targets_count entries,
+  // a reply with sequence number seq is stored in row (seq - first_seq) % window
+  struct ping_reply *replies;
+  uint32_t replies_capacity;
+  uint16_t window;
+  uint16_t first_seq;
+  int cycle_active;
+  
+  // send_pings only, indexes of the replies in the order they were matched,
+  // cycle_cond is signaled once expected replies are in or on each reply
+  // when the caller wants them as they come
+  uint32_t *matched;
+  uint32_t matched_count;
+  uint32_t expected;
+  int streaming;
+  pthread_cond_t cycle_cond;
+  
+  // send_pings with more than one worker, each sender thread sends the
+  // rounds to its own targets, expected is set once they are all done,
+  // the threads are started by the first cycle and wait on senders_cond
+  // for the next one until the pinger is freed
+  int senders_started;
+  int senders_exiting;
+  uint32_t senders_cycle;
+  pthread_cond_t senders_cond;
+  volatile int senders_active;
+  uint16_t senders_running;
+  uint32_t senders_sent;
+  uint16_t cycle_count;
+  mrb_int cycle_delay;    // usec
+  struct timespec cycle_started_at;
+  
+  // latencies of one target, used to compute the percentiles
+  mrb_int *samples;
+  uint16_t samples_capacity;
+
+  // continuous mode, the monitor thread sends a round every interval
+  pthread_t monitor;
+  pthread_cond_t monitor_cond;
+  int monitoring;
+  mrb_int monitor_interval;  // usec
+  mrb_int monitor_timeout;   // usec
+  struct latency_stats *stats;  // one per target, reset by each collect
+  uint32_t stats_count;         // kept after stop for a last collect
+  
+  // maximum number of requests sent per second, 0 means no limit
+  mrb_int max_pps;
+  
+  // time spent turning the replies into ruby values (nsec), only
+  // updated by the ruby thread
+  uint64_t aggregate_ns;
+  
+  // cycle started by start_pings, the caller polls notify_fd which is
+  // an epoll set with notify_event_fd (signaled by the receivers and the
+  // senders) and notify_timer_fd (expiring at the deadline), the event
+  // is only signaled once until the caller calls drain or step
+  int async;
+  uint16_t async_count;
+  struct timespec async_deadline;
+  uint32_t drained;
+#ifdef HAVE_EPOLL
+  int notify_fd;
+  int notify_event_fd;
+  int notify_timer_fd;
+  int notify_pending;
+#endif
 };
 
 
+// sleep until the given CLOCK_MONOTONIC time
+static void sleep_until(const struct timespec *deadline)
+{
+  while( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL) == EINTR )
+    ;
+}
+
+// nanoseconds elapsed since t (CLOCK_MONOTONIC)
+static uint64_t elapsed_ns(const struct timespec *t)
+{
+  struct timespec now;
+  
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)(now.tv_sec - t->tv_sec) * 1000000000ULL + (now.tv_nsec - t->tv_nsec);
+}
+
+#ifndef HAVE_EPOLL
+static void fill_timeout(struct timeval *tv, uint64_t duration)
+{
+  tv->tv_sec = 0;
+  while( duration >= 1000000 ){
+    duration -= 1000000;
+    tv->tv_sec += 1;
+  }
+  
+  tv->tv_usec = duration;
+}
+#endif
+
+// icmp id used for the requests sent to a target
+static uint16_t target_icmp_id(struct state *st, uint32_t index)
+{
+  uint16_t id = st->targets[index].uid;
+  
+  if( id == 0 ){
+    id = st->id_base;
+  }
+  
+  return id;
+}
+
+// key identifying a target in the results, the key of a target without
+// uid is its position when it was added and does not change afterwards
+static mrb_int target_key(struct state *st, uint32_t index)
+{
+  if( st->targets[index].uid != 0 )
+    return st->targets[index].uid;
+  
+  return st->targets[index].key;
+}
+
+static uint32_t random_u32(void)
+{
+  uint32_t value;
+  int fd = open("/dev/urandom", O_RDONLY);
+  
+  if( (fd == -1) || (read(fd, &value, sizeof(value)) != sizeof(value)) ){
+    struct timespec now;
+    
+    clock_gettime(CLOCK_REALTIME, &now);
+    value = (now.tv_sec * 1000000007) ^ now.tv_nsec ^ (getpid() << 16);
+  }
+  
+  if( fd != -1 )
+    close(fd);
+  
+  return value;
+}
+
+// keyed hash of the fields of a request payload (taken as they are on
+// the wire), not a MAC but the key never leaves the process so a forged
+// or altered reply only passes if the tag is guessed
+static uint32_t payload_tag(const struct state *st, const struct probe_payload *p)
+{
+  uint64_t h = st->tag_key;
+  
+  h ^= ((uint64_t)p->index << 32) | p->round;
+  h *= 0x9e3779b97f4a7c15ULL;
+  h ^= h >> 29;
+  h ^= ((uint64_t)p->sent_sec << 32) | p->sent_nsec;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 32;
+  h *= 0x94d049bb133111ebULL;
+  h ^= h >> 29;
+  
+  return (uint32_t) h;
+}
+
+// fill the payload of the request sent to target for round seq
+static void probe_payload_fill(const struct state *st, struct probe_payload *p, uint32_t target, uint16_t seq, const struct timespec *sent_at)
+{
+  p->cookie = st->cookie;
+  p->index = htonl(target);
+  p->round = htonl(seq);
+  p->sent_sec = htonl((uint32_t) sent_at->tv_sec);
+  p->sent_nsec = htonl((uint32_t) sent_at->tv_nsec);
+  p->tag = payload_tag(st, p);
+}
+
+// return 1 and the time the request was sent if we built this payload
+static int probe_payload_check(const struct state *st, const struct probe_payload *p, struct timespec *sent_at)
+{
+  if( (p->cookie != st->cookie) || (p->tag != payload_tag(st, p)) )
+    return 0;
+  
+  sent_at->tv_sec = ntohl(p->sent_sec);
+  sent_at->tv_nsec = ntohl(p->sent_nsec);
+  
+  return 1;
+}
+
+// take the replies_lock of every worker, the receivers are then
+// between two batches
+static void lock_replies(struct state *st)
+{
+  int i;
+  
+  for(i = 0; i< st->workers_count; i++){
+    pthread_mutex_lock(&st->workers[i].replies_lock);
+  }
+}
+
+static void unlock_replies(struct state *st)
+{
+  int i;
+  
+  for(i = st->workers_count - 1; i >= 0; i--){
+    pthread_mutex_unlock(&st->workers[i].replies_lock);
+  }
+}
+
+// end the current cycle for the receivers, a batch matched while
+// it was active is finished when this returns
+static void stop_matching(struct state *st)
+{
+  pthread_mutex_lock(&st->lock);
+  st->cycle_active = 0;
+  pthread_mutex_unlock(&st->lock);
+  
+  lock_replies(st);
+  unlock_replies(st);
+}
 
+static void stop_receiver(struct state *st);
+static void stop_worker_receiver(struct worker *w);
+static void stop_senders(struct state *st);
+static void exit_senders(struct state *st);
+static void stop_monitor(struct state *st);
+static void close_target_sockets(mrb_state *mrb, struct state *st);
+#ifdef HAVE_EPOLL
+static void close_notify_fd(struct state *st);
+#endif
 
 static void ping_state_free(mrb_state *mrb, void *ptr)
 {
   struct state *st = (struct state *)ptr;
+  
+  stop_monitor(st);
+  exit_senders(st);
+  stop_receiver(st);
+  
+  close_target_sockets(mrb, st);
+  
+#ifdef HAVE_SENDMMSG
+  if( st->simulated ){
+    int i;
+    
+    for(i = 0; i< st->workers_count; i++){
+      if( st->workers[i].sim != NULL )
+        simulator_stop(st->workers[i].sim);
+    }
+  }
+#endif
+  
   if( st->targets != NULL )
     FREE(st->targets);
+  
+  if( st->replies != NULL )
+    FREE(st->replies);
+  
+  if( st->matched != NULL )
+    FREE(st->matched);
+  
+  if( st->samples != NULL )
+    FREE(st->samples);
+
+  if( st->stats != NULL )
+    FREE(st->stats);
+  
+#ifdef HAVE_SENDMMSG
+  if( st->templates != NULL )
+    FREE(st->templates);
+  
+  if( st->send_order != NULL )
+    FREE(st->send_order);
+#endif
+  
+#ifdef HAVE_EPOLL
+  {
+    int i;
+    
+    for(i = 0; i< st->workers_count; i++){
+      close(st->workers[i].wakeup_fd);
+      close(st->workers[i].epoll_fd);
+    }
+    
+    close_notify_fd(st);
+  }
+#endif
+  
+  {
+    int i;
+    
+    for(i = 0; i< st->workers_count; i++){
+      pthread_mutex_destroy(&st->workers[i].replies_lock);
+    }
+  }
+  
+  FREE(st->workers);
+  
+  pthread_cond_destroy(&st->monitor_cond);
+  pthread_cond_destroy(&st->cycle_cond);
+  pthread_cond_destroy(&st->senders_cond);
+  pthread_mutex_destroy(&st->lock);
     
   FREE(st);
 }
 
 static struct mrb_data_type ping_state_type = { "Pinger", ping_state_free };
 
-static int init_capture_socket(mrb_state *mrb, struct state *st, struct target_address *ta)
+// return the index of the capture socket used for this target or -1
+static int capture_socket_index(struct state *st, struct target_address *ta, uint16_t shard)
 {
-  int i, ret = -1;
+  int i;
   
-  // first check if we already have a socket in this routing table/device
   for(i = 0; i< st->capture_sockets_count; i++){
     const char *device = NULL;
 #ifdef SO_BINDTODEVICE
     device = st->capture_sockets[i].device;
 #endif
-
+    
+    if( st->capture_sockets[i].shard != shard )
+      continue;
+    
+    // all the targets of a worker share its simulated network
+    if( st->simulated )
+      return i;
+    
+    // datagram sockets are also used to send so they are bound to the source address
+    if( st->dgram && (st->capture_sockets[i].in_addr_src != ta->in_addr_src) )
+      continue;
+    
     if( (st->capture_sockets[i].rtable == ta->rtable) && ( !device || !strcmp(device, ta->device) ) ){
-      ret = st->capture_sockets[i].socket;
-      break;
+      return i;
     }
   }
   
+  return -1;
+}
+
+// return the capture socket used for this target or -1
+static int find_capture_socket(struct state *st, struct target_address *ta, uint16_t shard)
+{
+  int i = capture_socket_index(st, ta, shard);
+  
+  return (i == -1) ? -1 : st->capture_sockets[i].socket;
+}
+
+#ifdef HAVE_TX_TIMESTAMPS
+
+static void enable_tx_timestamps(int sock)
+{
+  int flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+  
+  if( setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == -1 ){
+    perror("setsockopt(SO_TIMESTAMPING) ");
+  }
+}
+
+#endif
+
+// return the socket receiving the replies of this target, the socket of
+// an earlier target is shared when possible and each call takes a
+// reference on it, dropped by release_capture_socket
+static int acquire_capture_socket(mrb_state *mrb, struct state *st, struct target_address *ta, uint16_t shard)
+{
+  // first check if we already have a socket in this routing table/device
+  int index = capture_socket_index(st, ta, shard), ret, flags;
+  
+  if( index != -1 ){
+    st->capture_sockets[index].refs++;
+    return st->capture_sockets[index].socket;
+  }
+  
   // create it if none already exist
-  if( ret == -1 ){
-    int index = st->capture_sockets_count++;
+  if( st->simulated ){
+    ret = dup(st->workers[shard].sim_recv_fd);
+  }
+  else {
+    ret = socket(AF_INET, st->dgram ? SOCK_DGRAM : SOCK_RAW, IPPROTO_ICMP);
+  }
     
-    if( st->capture_sockets == NULL ){
-      st->capture_sockets = MALLOC(sizeof(struct capture_socket) * st->capture_sockets_count);
-    }
-    else {
-      st->capture_sockets = REALLOC(st->capture_sockets, sizeof(struct capture_socket) * st->capture_sockets_count);
-    }
+  if( ret == -1 )
+    return -1;
     
-    ret = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
+  // set the socket as non blocking
+  flags = fcntl(ret, F_GETFL);
+  if ( flags < 0){
+    perror("fnctl(GET) failed");
+    close(ret);
+    return -1;
+  }
 
-    if( ret != -1 ){
-      int flags;
+  flags |= O_NONBLOCK;
       
-      // set the socket as non blocking
-      flags = fcntl(ret, F_GETFL);
-      if ( flags < 0){
-        perror("fnctl(GET) failed");
-        return -1;
-      }
-      
-      flags |= O_NONBLOCK;
-      
-      if (fcntl(ret, F_SETFL, flags) < 0){
-        perror("fnctl(SET) failed\n");
-        return -1;
-      }
+  if (fcntl(ret, F_SETFL, flags) < 0){
+    perror("fnctl(SET) failed\n");
+    close(ret);
+    return -1;
+  }
       
 #ifdef __OpenBSD__
-      // force routing table, do nothing if rtable is 0 (default table)
-      if( ta->rtable != 0 ){
-        if( setsockopt(ret, SOL_SOCKET, SO_RTABLE, &ta->rtable, sizeof(ta->rtable)) == -1 ){
-          perror("setsockopt(SO_RTABLE) ");
-        }
-      }
+  // force routing table, do nothing if rtable is 0 (default table)
+  if( ta->rtable != 0 ){
+    if( setsockopt(ret, SOL_SOCKET, SO_RTABLE, &ta->rtable, sizeof(ta->rtable)) == -1 ){
+      perror("setsockopt(SO_RTABLE) ");
+    }
+  }
 #endif
 
 #ifdef SO_BINDTODEVICE
-      if( strlen(ta->device) > 0 ){
-        if( setsockopt(ret, SOL_SOCKET, SO_BINDTODEVICE, ta->device, strlen(ta->device) + 1) == -1 ){
-          perror("setsockopt(SO_BINDTODEVICE) ");
-        }
-      }
+  if( strlen(ta->device) > 0 ){
+    if( setsockopt(ret, SOL_SOCKET, SO_BINDTODEVICE, ta->device, strlen(ta->device) + 1) == -1 ){
+      perror("setsockopt(SO_BINDTODEVICE) ");
+    }
+  }
+#endif
+      
+#ifdef HAVE_PING_SOCKET
+  // the kernel picks a free icmp id for the socket
+  if( st->dgram ){
+    struct sockaddr_in local;
+        
+    bzero(&local, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = ta->in_addr_src;
+        
+    if( bind(ret, (struct sockaddr *) &local, sizeof(local)) == -1 ){
+      perror("bind ");
+      close(ret);
+      return -1;
+    }
+  }
+#endif
       
-      strncpy(st->capture_sockets[index].device, ta->device, IFNAMSIZ - 1);
+#ifdef SO_TIMESTAMPNS
+  {
+    int on = 1;
+        
+    // ask the kernel to timestamp the received packets
+    if( setsockopt(ret, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) == -1 ){
+      perror("setsockopt(SO_TIMESTAMPNS) ");
+    }
+  }
+#endif
+
+#ifdef SO_RXQ_OVFL
+  {
+    int on = 1;
+        
+    // and to tell how many packets it dropped because the queue was full
+    if( setsockopt(ret, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) == -1 ){
+      perror("setsockopt(SO_RXQ_OVFL) ");
+    }
+  }
+#endif
+
+#ifdef HAVE_TX_TIMESTAMPS
+  // datagram sockets send the requests themselves
+  if( st->dgram && st->tx_timestamps ){
+    enable_tx_timestamps(ret);
+  }
 #endif
       
-      st->capture_sockets[index].rtable = ta->rtable;
-      st->capture_sockets[index].socket = ret;
+#ifdef HAVE_EPOLL
+  {
+    struct epoll_event ev;
+        
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = ret;
+    if( epoll_ctl(st->workers[shard].epoll_fd, EPOLL_CTL_ADD, ret, &ev) == -1 ){
+      perror("epoll_ctl(ADD) ");
+      close(ret);
+      return -1;
     }
   }
+#endif
+      
+  index = st->capture_sockets_count++;
+  
+  if( st->capture_sockets == NULL ){
+    st->capture_sockets = MALLOC(sizeof(struct capture_socket) * st->capture_sockets_count);
+  }
+  else {
+    st->capture_sockets = REALLOC(st->capture_sockets, sizeof(struct capture_socket) * st->capture_sockets_count);
+  }
+  
+  bzero(&st->capture_sockets[index], sizeof(struct capture_socket));
+#ifdef SO_BINDTODEVICE
+  strncpy(st->capture_sockets[index].device, ta->device, IFNAMSIZ - 1);
+#endif
+  st->capture_sockets[index].shard = shard;
+  st->capture_sockets[index].rtable = ta->rtable;
+  st->capture_sockets[index].in_addr_src = ta->in_addr_src;
+  st->capture_sockets[index].socket = ret;
+  st->capture_sockets[index].drops = 0;
+  st->capture_sockets[index].refs = 1;
   
   return ret;
 }
 
-static libnet_t *find_libnet_context(struct state *st, const char *device)
+static void close_capture_socket(struct state *st, int index)
+{
+  // its receiver may be reading it, it is restarted by the next cycle
+  stop_worker_receiver(&st->workers[st->capture_sockets[index].shard]);
+
+#ifdef HAVE_EPOLL
+  epoll_ctl(st->workers[st->capture_sockets[index].shard].epoll_fd, EPOLL_CTL_DEL, st->capture_sockets[index].socket, NULL);
+#endif
+  
+  close(st->capture_sockets[index].socket);
+}
+
+// drop a reference taken by acquire_capture_socket, the socket is
+// closed when its last target is gone
+static void release_capture_socket(struct state *st, struct target_address *ta, uint16_t shard)
+{
+  int index = capture_socket_index(st, ta, shard);
+  
+  if( (index == -1) || (--st->capture_sockets[index].refs > 0) )
+    return;
+  
+  close_capture_socket(st, index);
+  
+  // the order is kept so the remaining targets find the same sockets
+  memmove(&st->capture_sockets[index], &st->capture_sockets[index + 1],
+      (st->capture_sockets_count - index - 1) * sizeof(struct capture_socket)
+    );
+  st->capture_sockets_count--;
+}
+
+static int libnet_context_index(struct state *st, const char *device)
 {
   int i;
-  libnet_t *ret = NULL;
   
   for(i = 0; i< st->libnet_contexts_count; i++){
     const char *context_device = libnet_getdevice(st->libnet_contexts[i]);
@@ -144,482 +780,2701 @@ static libnet_t *find_libnet_context(struct state *st, const char *device)
     // a libnet context already exists for this device, returns it and stop searching
     // if a device was not specified, take the first one
     if( !device || (strlen(device) == 0) || !strcmp(context_device, device) ){
-      ret = st->libnet_contexts[i];
-      break;
+      return i;
     }
   }
 
+  return -1;
+}
+
+static libnet_t *find_libnet_context(struct state *st, const char *device)
+{
+  int i = libnet_context_index(st, device);
   
-  return ret;
+  return (i == -1) ? NULL : st->libnet_contexts[i];
 }
 
-static int init_libnet_context(mrb_state *mrb, struct state *st, const char *device)
+// take a reference on the libnet context of this device, it is created
+// if needed, return -1 if it cannot be (the reason is in errbuf)
+static int acquire_libnet_context(mrb_state *mrb, struct state *st, const char *device)
 {
+  int index = libnet_context_index(st, device);
   libnet_t *l;
   
-  l = find_libnet_context(st, device);
-  if( l == NULL ){
-    // context not found, create a new one
-    // we reuse the same error buffer since we are not multithreaded for this part
-    l = libnet_init(LIBNET_RAW4, device, errbuf);
-    if( l > 0 ){
-      int index = st->libnet_contexts_count++;
+  if( index != -1 ){
+    st->libnet_contexts_refs[index]++;
+    return 0;
+  }
       
-      if( st->libnet_contexts == NULL ){
-        st->libnet_contexts = MALLOC(sizeof(libnet_t*) * st->libnet_contexts_count);
-      }
-      else {
-        st->libnet_contexts = REALLOC(st->libnet_contexts, sizeof(libnet_t*) * st->capture_sockets_count);
-      }
+  // context not found, create a new one
+  // we reuse the same error buffer since we are not multithreaded for this part
+  l = libnet_init(LIBNET_RAW4, device, errbuf);
+  if( l == NULL )
+    return -1;
+  
+  index = st->libnet_contexts_count++;
+  
+  if( st->libnet_contexts == NULL ){
+    st->libnet_contexts = MALLOC(sizeof(libnet_t*) * st->libnet_contexts_count);
+    st->libnet_contexts_refs = MALLOC(sizeof(uint32_t) * st->libnet_contexts_count);
+  }
+  else {
+    st->libnet_contexts = REALLOC(st->libnet_contexts, sizeof(libnet_t*) * st->libnet_contexts_count);
+    st->libnet_contexts_refs = REALLOC(st->libnet_contexts_refs, sizeof(uint32_t) * st->libnet_contexts_count);
+  }
       
 #ifdef SO_BINDTODEVICE
-      if( device && strlen(device) > 0 ){
-        if( setsockopt(libnet_getfd(l), SOL_SOCKET, SO_BINDTODEVICE, device, strlen(device) + 1) == -1 ){
-          perror("setsockopt(SO_BINDTODEVICE) ");
-        }
-      }
-#endif
-      
-      st->libnet_contexts[index] = l;
-      printf("** Created new context for device '%s' , fd: %d\n", device, libnet_getfd(l));
+  if( device && strlen(device) > 0 ){
+    if( setsockopt(libnet_getfd(l), SOL_SOCKET, SO_BINDTODEVICE, device, strlen(device) + 1) == -1 ){
+      perror("setsockopt(SO_BINDTODEVICE) ");
     }
   }
-    
-  return (l != NULL);
+#endif
+
+#ifdef HAVE_TX_TIMESTAMPS
+  if( st->tx_timestamps ){
+    struct epoll_event ev;
+        
+    enable_tx_timestamps(libnet_getfd(l));
+        
+    // nothing is received on this socket, the first receiver is only
+    // woken up (EPOLLERR) when timestamps are queued
+    ev.events = 0;
+    ev.data.fd = libnet_getfd(l);
+    if( epoll_ctl(st->workers[0].epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev) == -1 ){
+      perror("epoll_ctl(ADD) ");
+    }
+  }
+#endif
+      
+  st->libnet_contexts[index] = l;
+  st->libnet_contexts_refs[index] = 1;
+  
+  return 0;
+}
+
+static void close_libnet_context(struct state *st, int index)
+{
+#ifdef HAVE_TX_TIMESTAMPS
+  if( st->tx_timestamps ){
+    // the first receiver reads its timestamps
+    stop_receiver(st);
+    epoll_ctl(st->workers[0].epoll_fd, EPOLL_CTL_DEL, libnet_getfd(st->libnet_contexts[index]), NULL);
+  }
+#endif
+    
+  libnet_destroy(st->libnet_contexts[index]);
+}
+
+// drop a reference taken by acquire_libnet_context, the context is
+// destroyed when its last target is gone
+static void release_libnet_context(struct state *st, const char *device)
+{
+  int index = libnet_context_index(st, device);
+  
+  if( (index == -1) || (--st->libnet_contexts_refs[index] > 0) )
+    return;
+  
+  close_libnet_context(st, index);
+  
+  // the order is kept, the targets without device use the first context
+  memmove(&st->libnet_contexts[index], &st->libnet_contexts[index + 1],
+      (st->libnet_contexts_count - index - 1) * sizeof(libnet_t*)
+    );
+  memmove(&st->libnet_contexts_refs[index], &st->libnet_contexts_refs[index + 1],
+      (st->libnet_contexts_count - index - 1) * sizeof(uint32_t)
+    );
+  st->libnet_contexts_count--;
+}
+
+#ifdef HAVE_SENDMMSG
+
+// standard internet checksum
+static uint16_t checksum(const void *data, size_t len)
+{
+  const uint16_t *p = data;
+  uint32_t sum = 0;
+  
+  while( len > 1 ){
+    sum += *p++;
+    len -= 2;
+  }
+  
+  if( len == 1 ){
+    sum += *(const uint8_t *)p;
+  }
+  
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+  
+  return ~sum;
+}
+
+// set the sequence number and the payload of a prebuilt request for
+// this round, the checksum only covers 32 bytes so it is recomputed
+static void probe_template_stamp(struct state *st, struct probe_template *t, uint32_t target, uint16_t seq, const struct timespec *sent_at)
+{
+  struct icmp *pkt = (struct icmp *)(t->packet + LIBNET_IPV4_H);
+  struct probe_payload *payload = (struct probe_payload *)(t->packet + LIBNET_IPV4_H + LIBNET_ICMPV4_ECHO_H);
+  
+  pkt->icmp_seq = htons(seq);
+  probe_payload_fill(st, payload, target, seq, sent_at);
+  
+  pkt->icmp_cksum = 0;
+  pkt->icmp_cksum = checksum(pkt, LIBNET_ICMPV4_ECHO_H + sizeof(struct probe_payload));
+}
+
+// build the echo request of target i, the ip header is handled
+// by the libnet raw socket (IP_HDRINCL), the kernel will fill the
+// ip checksum, ip id and source address when they are zero
+static void build_probe_template(struct state *st, uint32_t i)
+{
+  struct probe_template *t = &st->templates[i];
+  struct ip *iphdr = (struct ip *)t->packet;
+  struct icmp *pkt = (struct icmp *)(t->packet + LIBNET_IPV4_H);
+  struct probe_payload *payload = (struct probe_payload *)(t->packet + LIBNET_IPV4_H + LIBNET_ICMPV4_ECHO_H);
+  const char *device = NULL;
+
+#ifdef SO_BINDTODEVICE
+  device = st->targets[i].device;
+#endif
+  
+  bzero(t, sizeof(struct probe_template));
+  
+  if( st->simulated ){
+    t->socket = st->workers[i % st->workers_count].sim_send_fd;
+  }
+  else if( st->dgram ){
+    t->socket = find_capture_socket(st, &st->targets[i], i % st->workers_count);
+  }
+  else {
+    t->socket = libnet_getfd( find_libnet_context(st, device) );
+  }
+  t->dst.sin_family = AF_INET;
+  t->dst.sin_addr.s_addr = st->targets[i].in_addr;
+  
+  iphdr->ip_v = 4;
+  iphdr->ip_hl = LIBNET_IPV4_H >> 2;
+  iphdr->ip_len = htons(sizeof(t->packet));
+  iphdr->ip_ttl = (st->targets[i].in_addr_src != 0) ? 100 : 64;
+  iphdr->ip_p = IPPROTO_ICMP;
+  iphdr->ip_src.s_addr = st->targets[i].in_addr_src;
+  iphdr->ip_dst.s_addr = st->targets[i].in_addr;
+  
+  pkt->icmp_type = ICMP_ECHO;
+  pkt->icmp_code = 0;
+  pkt->icmp_id = htons(target_icmp_id(st, i));
+  pkt->icmp_seq = 0;
+  
+  // the payload and the checksum are set when sending
+  payload->cookie = st->cookie;
+  payload->index = htonl(i);
+}
+
+// split the targets between the workers, this only walks the templates
+// so it is redone after every change of the targets
+static void build_send_order(struct state *st)
+{
+  uint32_t next[MAX_WORKERS];
+  uint32_t i, n = 0;
+  int c;
+  
+  // each worker gets a contiguous part of send_order
+  for(c = 0; c< st->workers_count; c++){
+    struct worker *w = &st->workers[c];
+    
+    w->send_start = n;
+    w->send_count = (st->targets_count + st->workers_count - 1 - c) / st->workers_count;
+    next[c] = n;
+    n += w->send_count;
+  }
+  
+  // a simulated network has a single socket per worker
+  if( st->simulated ){
+    for(i = 0; i< st->targets_count; i++){
+      st->send_order[ next[i % st->workers_count]++ ] = i;
+    }
+    
+    return;
+  }
+  
+  // and its targets are grouped by sending socket
+  for(c = 0; c< (st->dgram ? st->capture_sockets_count : st->libnet_contexts_count); c++){
+    int sock = st->dgram ? st->capture_sockets[c].socket : libnet_getfd(st->libnet_contexts[c]);
+    
+    for(i = 0; i< st->targets_count; i++){
+      if( st->templates[i].socket == sock ){
+        st->send_order[ next[i % st->workers_count]++ ] = i;
+      }
+    }
+  }
+}
+
+#endif
+
+#ifdef HAVE_SOCKET_FILTER
+
+// only let our echo replies reach the capture sockets: the kernel drops
+// everything else (other icmp types, replies to other tools or to the
+// targets of other workers) before it is queued and only copies the part
+// of the packet we look at
+static void attach_reply_filter(struct state *st)
+{
+  uint16_t uid_min = st->id_base, uid_max = st->id_base;
+  struct sock_fprog prog;
+  int i, first = 1;
+  
+  for(i = 0; i< st->targets_count; i++){
+    uint16_t uid = st->targets[i].uid;
+    
+    if( uid == 0 )
+      continue;
+    
+    if( first || (uid < uid_min) )
+      uid_min = uid;
+    
+    if( first || (uid > uid_max) )
+      uid_max = uid;
+    
+    first = 0;
+  }
+  
+  for(i = 0; i< st->capture_sockets_count; i++){
+    struct sock_filter code[] = {
+      BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),                         // x = ip header length
+      BPF_STMT(BPF_LD | BPF_B | BPF_IND, 0),                          // icmp type
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_ECHOREPLY, 0, 10),
+      BPF_STMT(BPF_LD | BPF_W | BPF_IND, LIBNET_ICMPV4_ECHO_H),       // payload cookie
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohl(st->cookie), 0, 8),
+      BPF_STMT(BPF_LD | BPF_H | BPF_IND, 4),                          // icmp id
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, st->id_base, 2, 0),
+      BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, uid_min, 0, 5),
+      BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, uid_max, 4, 0),
+      BPF_STMT(BPF_LD | BPF_W | BPF_IND, LIBNET_ICMPV4_ECHO_H + 4),   // payload target index
+      BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, st->workers_count),
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, st->capture_sockets[i].shard, 0, 1),
+      BPF_STMT(BPF_RET | BPF_K, RECV_PACKET_SIZE),                    // accept
+      BPF_STMT(BPF_RET | BPF_K, 0)                                    // drop
+    };
+    
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+    
+    // a new filter replaces the previous one
+    if( setsockopt(st->capture_sockets[i].socket, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) == -1 ){
+      perror("setsockopt(SO_ATTACH_FILTER) ");
+    }
+  }
+}
+
+#endif
+
+#ifdef HAVE_EPOLL
+
+// create the epoll set of a worker with its wakeup event
+static int init_worker_epoll(struct worker *w)
+{
+  struct epoll_event ev;
+  
+  w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  w->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  
+  if( (w->epoll_fd == -1) || (w->wakeup_fd == -1) ){
+    return -1;
+  }
+  
+  ev.events = EPOLLIN;
+  ev.data.fd = w->wakeup_fd;
+  if( epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->wakeup_fd, &ev) == -1 ){
+    return -1;
+  }
+  
+  return 0;
+}
+
+static void close_notify_fd(struct state *st)
+{
+  if( st->notify_fd != -1 ) close(st->notify_fd);
+  if( st->notify_event_fd != -1 ) close(st->notify_event_fd);
+  if( st->notify_timer_fd != -1 ) close(st->notify_timer_fd);
+  
+  st->notify_fd = st->notify_event_fd = st->notify_timer_fd = -1;
+}
+
+// create the descriptors used by start_pings on first use
+static int init_notify_fd(struct state *st)
+{
+  struct epoll_event ev;
+  
+  if( st->notify_fd != -1 )
+    return 0;
+  
+  st->notify_fd = epoll_create1(EPOLL_CLOEXEC);
+  st->notify_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  st->notify_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  
+  if( (st->notify_fd == -1) || (st->notify_event_fd == -1) || (st->notify_timer_fd == -1) ){
+    close_notify_fd(st);
+    return -1;
+  }
+  
+  ev.events = EPOLLIN;
+  ev.data.fd = st->notify_event_fd;
+  if( epoll_ctl(st->notify_fd, EPOLL_CTL_ADD, st->notify_event_fd, &ev) == -1 ){
+    close_notify_fd(st);
+    return -1;
+  }
+  
+  ev.data.fd = st->notify_timer_fd;
+  if( epoll_ctl(st->notify_fd, EPOLL_CTL_ADD, st->notify_timer_fd, &ev) == -1 ){
+    close_notify_fd(st);
+    return -1;
+  }
+  
+  return 0;
+}
+
+// make notify_fd not readable anymore, the next match or the
+// end of the sending will signal it again
+static void clear_notifications(struct state *st)
+{
+  uint64_t value;
+  
+  if( st->notify_fd == -1 )
+    return;
+  
+  pthread_mutex_lock(&st->lock);
+  st->notify_pending = 0;
+  if( (read(st->notify_event_fd, &value, sizeof(value)) == -1) && (errno != EAGAIN) ){
+    perror("read(eventfd)");
+  }
+  pthread_mutex_unlock(&st->lock);
+  
+  if( (read(st->notify_timer_fd, &value, sizeof(value)) == -1) && (errno != EAGAIN) ){
+    perror("read(timerfd)");
+  }
+}
+
+#endif
+
+#ifdef HAVE_SENDMMSG
+
+// start the simulated network of each worker, the worker index is used
+// as stream so they do not draw the same random numbers
+static int start_simulators(struct state *st)
+{
+  int i;
+  
+  for(i = 0; i< st->workers_count; i++){
+    struct worker *w = &st->workers[i];
+    
+    w->sim = simulator_start(&st->sim_config, w->shard, &w->sim_send_fd, &w->sim_recv_fd);
+    if( w->sim == NULL ){
+      int j;
+      
+      for(j = 0; j< i; j++){
+        simulator_stop(st->workers[j].sim);
+        st->workers[j].sim = NULL;
+      }
+      
+      return -1;
+    }
+  }
+  
+  return 0;
 }
 
+#endif
+
 static mrb_value ping_initialize(mrb_state *mrb, mrb_value self)
 {
+  mrb_bool dgram = 0, tx_timestamps = 0;
+  mrb_int workers = 1;
+  mrb_value simulation = mrb_nil_value();
+  struct simulator_config sim_config;
+  struct state *st;
+  int i;
+  
+  mrb_get_args(mrb, "|bibo", &dgram, &workers, &tx_timestamps, &simulation);
+  
+  if( (workers < 1) || (workers > MAX_WORKERS) ){
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "workers should be between 1 and %S", mrb_fixnum_value(MAX_WORKERS));
+  }
+  
+  if( !mrb_nil_p(simulation) ){
+#ifndef HAVE_SENDMMSG
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "the simulated backend is not supported on this platform");
+#endif
+    
+    if( dgram || tx_timestamps ){
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "the simulated backend cannot be used with datagram sockets or kernel timestamping");
+    }
+    
+    parse_simulator_config(mrb, simulation, &sim_config);
+  }
+  
+#ifndef HAVE_SENDMMSG
+  // libnet contexts cannot be shared between threads
+  if( workers > 1 ){
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "multiple workers are not supported on this platform");
+  }
+#endif
+  
+#ifndef HAVE_PING_SOCKET
+  if( dgram ){
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "datagram icmp sockets are not supported on this platform");
+  }
+#endif
+
+#ifndef HAVE_TX_TIMESTAMPS
+  if( tx_timestamps ){
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "kernel timestamping is not supported on this platform");
+  }
+#endif
+  
+  st = MALLOC(sizeof(struct state));
+  
+  bzero(st, sizeof(struct state));
+  
+  st->dgram = dgram;
+  st->tx_timestamps = tx_timestamps;
+  
+#ifdef HAVE_EPOLL
+  st->notify_fd = st->notify_event_fd = st->notify_timer_fd = -1;
+#endif
+  
+  if( !mrb_nil_p(simulation) ){
+    st->simulated = 1;
+    st->sim_config = sim_config;
+  }
+  
+  st->capture_sockets = NULL;
+  st->capture_sockets_count = 0;
+  
+  st->targets = NULL;
+  
+  st->libnet_contexts = NULL;
+  st->libnet_contexts_refs = NULL;
+  st->libnet_contexts_count = 0;
+  
+#ifdef HAVE_SENDMMSG
+  st->templates = NULL;
+  st->send_order = NULL;
+#endif
+  
+  // 0 is left to the targets with no uid
+  st->cookie = random_u32();
+  st->tag_key = ((uint64_t)random_u32() << 32) | random_u32();
+  do {
+    st->id_base = random_u32();
+  } while( st->id_base == 0 );
+  
+  st->next_key = 100;
+  
+  pthread_mutex_init(&st->lock, NULL);
+  
+  {
+    pthread_condattr_t attr;
+    
+    // both conditions are waited for with deadlines on the monotonic clock
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&st->monitor_cond, &attr);
+    pthread_cond_init(&st->cycle_cond, &attr);
+    pthread_condattr_destroy(&attr);
+  }
+  
+  pthread_cond_init(&st->senders_cond, NULL);
+
+  st->workers_count = workers;
+  st->workers = MALLOC(sizeof(struct worker) * st->workers_count);
+  bzero(st->workers, sizeof(struct worker) * st->workers_count);
+  
+  for(i = 0; i< st->workers_count; i++){
+    st->workers[i].st = st;
+    st->workers[i].shard = i;
+    
+#ifdef HAVE_EPOLL
+    st->workers[i].epoll_fd = -1;
+    st->workers[i].wakeup_fd = -1;
+    
+    if( init_worker_epoll(&st->workers[i]) == -1 ){
+      int j;
+      
+      for(j = 0; j<= i; j++){
+        if( st->workers[j].epoll_fd != -1 ) close(st->workers[j].epoll_fd);
+        if( st->workers[j].wakeup_fd != -1 ) close(st->workers[j].wakeup_fd);
+      }
+      
+      FREE(st->workers);
+      FREE(st);
+      mrb_raise(mrb, E_RUNTIME_ERROR, "cannot create epoll/event descriptors");
+    }
+#endif
+  }
+
+#ifdef HAVE_SENDMMSG
+  if( st->simulated && (start_simulators(st) == -1) ){
+#ifdef HAVE_EPOLL
+    for(i = 0; i< st->workers_count; i++){
+      close(st->workers[i].epoll_fd);
+      close(st->workers[i].wakeup_fd);
+    }
+#endif
+    
+    FREE(st->workers);
+    FREE(st);
+    mrb_raise(mrb, E_RUNTIME_ERROR, "cannot start the simulated network");
+  }
+#endif
+  
+  for(i = 0; i< st->workers_count; i++){
+    pthread_mutex_init(&st->workers[i].replies_lock, NULL);
+  }
+  
+  DATA_PTR(self)  = (void*)st;
+  DATA_TYPE(self) = &ping_state_type;
+  
+  return self;
+}
+
+// close every capture socket and libnet context, the targets table is
+// left as it is
+static void close_target_sockets(mrb_state *mrb, struct state *st)
+{
+  int i;
+  
+  for(i = 0; i< st->capture_sockets_count; i++){
+    close_capture_socket(st, i);
+  }
+  
+  for(i = 0; i< st->libnet_contexts_count; i++){
+    close_libnet_context(st, i);
+  }
+  
+  if( st->capture_sockets != NULL ){
+    FREE(st->capture_sockets);
+    st->capture_sockets = NULL;
+    st->capture_sockets_count = 0;
+  }
+  
+  if( st->libnet_contexts != NULL ){
+    FREE(st->libnet_contexts);
+    FREE(st->libnet_contexts_refs);
+    st->libnet_contexts = NULL;
+    st->libnet_contexts_refs = NULL;
+    st->libnet_contexts_count = 0;
+  }
+}
+
+// the targets only change between cycles, stop what may still run from
+// a cycle interrupted by an exception
+static void begin_targets_change(mrb_state *mrb, struct state *st)
+{
+  if( st->monitoring ){
+    mrb_raise(mrb, E_RUNTIME_ERROR, "cannot change targets while monitoring");
+  }
+  
+  if( st->async ){
+    mrb_raise(mrb, E_RUNTIME_ERROR, "cannot change targets while a cycle is running");
+  }
+  
+  stop_senders(st);
+  stop_matching(st);
+  
+  // the stats left by the last monitoring are for the old targets
+  if( st->stats != NULL ){
+    FREE(st->stats);
+    st->stats = NULL;
+    st->stats_count = 0;
+  }
+
+#ifndef HAVE_EPOLL
+  // the select() receiver walks the capture sockets list, it will be
+  // restarted by the next cycle
+  stop_receiver(st);
+#endif
+}
+  
+// build the templates of the targets added from index first and
+// update what depends on the whole table
+static void end_targets_change(mrb_state *mrb, struct state *st, uint32_t first)
+{
+#ifdef HAVE_SENDMMSG
+  uint32_t i;
+  
+  for(i = first; i< st->targets_count; i++){
+    build_probe_template(st, i);
+  }
+  
+  build_send_order(st);
+  
+  // room for two rounds of each worker in the simulated network
+  if( st->simulated ){
+    int c;
+    
+    for(c = 0; c< st->workers_count; c++){
+      simulator_set_queue(st->workers[c].sim, 2 * st->workers[c].send_count);
+    }
+  }
+#endif
+
+#ifdef HAVE_SOCKET_FILTER
+  // datagram sockets only get the replies to their own id already and
+  // the simulated network only answers our requests
+  if( !st->dgram && !st->simulated ){
+    attach_reply_filter(st);
+  }
+#endif
+}
+
+// make room for count targets, the table only grows
+static void reserve_targets(mrb_state *mrb, struct state *st, uint32_t count)
+{
+  uint32_t capacity = (st->targets_capacity > 0) ? st->targets_capacity : 16;
+  
+  if( count <= st->targets_capacity )
+    return;
+  
+  while( capacity < count ){
+    capacity = (capacity > UINT32_MAX / 2) ? count : capacity * 2;
+  }
+  
+  if( st->targets == NULL ){
+    st->targets = MALLOC(sizeof(struct target_address) * capacity);
+  }
+  else {
+    st->targets = REALLOC(st->targets, sizeof(struct target_address) * capacity);
+  }
+
+#ifdef HAVE_SENDMMSG
+  if( st->templates == NULL ){
+    st->templates = MALLOC(sizeof(struct probe_template) * capacity);
+    st->send_order = MALLOC(sizeof(uint32_t) * capacity);
+  }
+  else {
+    st->templates = REALLOC(st->templates, sizeof(struct probe_template) * capacity);
+    st->send_order = REALLOC(st->send_order, sizeof(uint32_t) * capacity);
+  }
+#endif
+  
+  st->targets_capacity = capacity;
+}
+
+// fill ta from [addr, rtable, uid, interface, source address]
+static void parse_target(mrb_state *mrb, mrb_value arr, struct target_address *ta)
+{
+  mrb_value r_addr = mrb_ary_ref(mrb, arr, 0);
+  mrb_value r_rtable = mrb_ary_ref(mrb, arr, 1);
+  mrb_value r_uid = mrb_ary_ref(mrb, arr, 2);
+  mrb_value r_src_addr = mrb_ary_ref(mrb, arr, 4);
+
+#ifdef SO_BINDTODEVICE
+  mrb_value r_ifname = mrb_ary_ref(mrb, arr, 3);
+#endif
+  
+  if( !mrb_string_p(r_addr) ){
+    mrb_raisef(mrb, E_TYPE_ERROR, "can't convert %s into String", mrb_obj_classname(mrb, r_addr));
+  }
+  
+  ta->rtable = mrb_fixnum(r_rtable);
+  ta->in_addr = inet_addr( mrb_str_to_cstr(mrb, r_addr) );
+  
+  if( mrb_nil_p(r_src_addr) ){
+    ta->in_addr_src = 0;
+  }
+  else {
+    ta->in_addr_src = inet_addr( mrb_str_to_cstr(mrb, r_src_addr) );
+  }
+  
+  ta->uid = (uint16_t) mrb_fixnum(r_uid);
+  
+  bzero(ta->device, sizeof(ta->device));
+
+#ifdef SO_BINDTODEVICE
+  if( !mrb_nil_p(r_ifname) ){
+    strncpy(ta->device, mrb_str_to_cstr(mrb, r_ifname), sizeof(ta->device) - 1);
+  }
+#endif
+}
+
+// device the requests to this target are sent from, NULL for any
+static const char *target_device(struct target_address *ta)
+{
+#ifdef SO_BINDTODEVICE
+  if( strlen(ta->device) > 0 )
+    return ta->device;
+#endif
+  
+  return NULL;
+}
+
+// take the sockets needed by target index, return 0, -1 if the capture
+// socket cannot be created or -2 for the libnet context
+static int acquire_target_sockets(mrb_state *mrb, struct state *st, uint32_t index)
+{
+  struct target_address *ta = &st->targets[index];
+  
+  if( acquire_capture_socket(mrb, st, ta, index % st->workers_count) == -1 )
+    return -1;
+  
+  // datagram and simulated sockets send by themselves
+  if( !st->dgram && !st->simulated && (acquire_libnet_context(mrb, st, target_device(ta)) == -1) ){
+    release_capture_socket(st, ta, index % st->workers_count);
+    return -2;
+  }
+  
+  return 0;
+}
+
+static void release_target_sockets(struct state *st, uint32_t index)
+{
+  struct target_address *ta = &st->targets[index];
+  
+  release_capture_socket(st, ta, index % st->workers_count);
+  
+  if( !st->dgram && !st->simulated ){
+    release_libnet_context(st, target_device(ta));
+  }
+}
+
+static void raise_socket_error(mrb_state *mrb, struct state *st, int error)
+{
+  if( error == -2 ){
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "cannot create libnet context: %S", mrb_str_new_cstr(mrb, errbuf));
+  }
+  
+  if( st->simulated ){
+    mrb_raise(mrb, E_RUNTIME_ERROR, "cannot create simulated socket");
+  }
+  
+  if( st->dgram ){
+    mrb_raise(mrb, E_RUNTIME_ERROR, "cannot create icmp socket, is our group in net.ipv4.ping_group_range ?");
+  }
+  
+  mrb_raise(mrb, E_RUNTIME_ERROR, "cannot create icmp socket, are you root ?");
+}
+
+// append the targets of arr at the end of the table, on error the
+// targets before the failing one are kept
+static void add_targets(mrb_state *mrb, struct state *st, mrb_value arr)
+{
+  uint32_t first = st->targets_count, count;
+  mrb_int n;
+  int ai = mrb_gc_arena_save(mrb);
+  
+  if( RARRAY_LEN(arr) > UINT32_MAX - st->targets_count ){
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "too many targets");
+  }
+  
+  count = RARRAY_LEN(arr);
+  reserve_targets(mrb, st, first + count);
+  
+  // parse them all first, nothing is changed if one is invalid
+  for(n = 0; n< count; n++){
+    parse_target(mrb, mrb_ary_ref(mrb, arr, n), &st->targets[first + n]);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  
+  for(n = 0; n< count; n++){
+    int ret = acquire_target_sockets(mrb, st, first + n);
+    
+    if( ret != 0 ){
+      end_targets_change(mrb, st, first);
+      raise_socket_error(mrb, st, ret);
+    }
+    
+    st->targets[first + n].key = st->next_key++;
+    st->targets_count++;
+  }
+  
+  end_targets_change(mrb, st, first);
+}
+
+// remove target index, the last target takes its place so only one
+// entry moves, return 0 or the error of acquire_target_sockets
+static int remove_target(mrb_state *mrb, struct state *st, uint32_t index)
+{
+  uint32_t last = st->targets_count - 1;
+  
+  // the moved target may belong to another worker now, its new
+  // socket is taken first so nothing changes if that fails
+  if( index != last ){
+    int ret = acquire_capture_socket(mrb, st, &st->targets[last], index % st->workers_count);
+    
+    if( ret == -1 )
+      return -1;
+  }
+  
+  release_target_sockets(st, index);
+  
+  if( index != last ){
+    release_capture_socket(st, &st->targets[last], last % st->workers_count);
+    st->targets[index] = st->targets[last];
+#ifdef HAVE_SENDMMSG
+    build_probe_template(st, index);
+#endif
+  }
+  
+  st->targets_count--;
+  
+  return 0;
+}
+
+static mrb_value ping_clear_targets(mrb_state *mrb, mrb_value self)
+{
+  struct state *st = DATA_PTR(self);
+  
+  begin_targets_change(mrb, st);
+  
+  close_target_sockets(mrb, st);
+  st->targets_count = 0;
+  st->next_key = 100;
+  
+  end_targets_change(mrb, st, 0);
+  
+  return self;
+}
+
+// replace all the targets, every socket is created again
+static mrb_value ping_set_targets(mrb_state *mrb, mrb_value self)
+{
+  mrb_value arr;
+  struct state *st = DATA_PTR(self);
+  
+  mrb_get_args(mrb, "A", &arr);
+  
+  begin_targets_change(mrb, st);
+  
+  close_target_sockets(mrb, st);
+  st->targets_count = 0;
+  st->next_key = 100;
+  
+  add_targets(mrb, st, arr);
+  
+  return self;
+}
+
+// add targets without touching the existing ones, the sockets they
+// need are shared with the targets already there when possible
+static mrb_value ping_add_targets(mrb_state *mrb, mrb_value self)
+{
+  mrb_value arr;
+  struct state *st = DATA_PTR(self);
+  
+  mrb_get_args(mrb, "A", &arr);
+  
+  begin_targets_change(mrb, st);
+  add_targets(mrb, st, arr);
+  
+  return self;
+}
+
+// remove the targets at these indexes one after the other, each removal
+// moves the last target to the freed index (the ruby side does the same)
+static mrb_value ping_remove_targets(mrb_state *mrb, mrb_value self)
+{
+  mrb_value arr;
+  struct state *st = DATA_PTR(self);
+  mrb_int n;
+  
+  mrb_get_args(mrb, "A", &arr);
+  
+  begin_targets_change(mrb, st);
+  
+  for(n = 0; n< RARRAY_LEN(arr); n++){
+    mrb_int index = mrb_fixnum(mrb_to_int(mrb, mrb_ary_ref(mrb, arr, n)));
+    int ret;
+    
+    if( (index < 0) || (index >= st->targets_count) ){
+      end_targets_change(mrb, st, st->targets_count);
+      mrb_raisef(mrb, E_INDEX_ERROR, "target index out of range: %S", mrb_fixnum_value(index));
+    }
+    
+    ret = remove_target(mrb, st, index);
+    if( ret != 0 ){
+      end_targets_change(mrb, st, st->targets_count);
+      raise_socket_error(mrb, st, ret);
+    }
+  }
+  
+  end_targets_change(mrb, st, st->targets_count);
+  
+  return self;
+}
+
+  
+// wake up the caller of start_pings, called with the state lock held
+static void notify_caller(struct state *st)
+{
+#ifdef HAVE_EPOLL
+  uint64_t one = 1;
+  
+  if( !st->async || st->notify_pending )
+    return;
+  
+  if( write(st->notify_event_fd, &one, sizeof(one)) == -1 ){
+    perror("write(eventfd)");
+  }
+  
+  st->notify_pending = 1;
+#endif
+}
+
+// check if the packet is one of our echo replies and record when we got it,
+// returns 1 and sets index when the reply goes to the matched list, called
+// by the receiver of the worker with its replies_lock held
+static int match_echo_reply(struct worker *w, const uint8_t *packet, size_t len, in_addr_t from, const struct timespec *received_at, uint32_t *index)
+{
+  struct state *st = w->st;
+  struct counters *c = &w->counters;
+  const struct ip *iphdr = (const struct ip *) packet;
+  const struct icmp *pkt;
+  struct probe_payload payload;
+  struct ping_reply *reply;
+  struct timespec sent_at;
+  uint32_t target;
+  mrb_int rtt;
+  uint16_t seq;
+  
+  if( !__atomic_load_n(&st->cycle_active, __ATOMIC_ACQUIRE) ){
+    COUNTER_ADD(c, late, 1);
+    return 0;
+  }
+  
+  if( st->dgram ){
+    // datagram sockets only return the icmp message
+    if( len < LIBNET_ICMPV4_ECHO_H + sizeof(payload) )
+      goto unmatched;
+    
+    pkt = (const struct icmp *) packet;
+  }
+  else {
+    // we need the ip header, the icmp header and our payload
+    if( (len < LIBNET_IPV4_H + LIBNET_ICMPV4_ECHO_H) || (len < (iphdr->ip_hl << 2) + LIBNET_ICMPV4_ECHO_H + sizeof(payload)) )
+      goto unmatched;
+    
+    pkt = (const struct icmp *) (packet + (iphdr->ip_hl << 2));      /* skip ip hdr */
+  }
+  
+  if( pkt->icmp_type != ICMP_ECHOREPLY )
+    goto unmatched;
+    
+  seq = ntohs(pkt->icmp_seq);
+  
+  // the payload tells which target and round the reply is for and when the
+  // request was sent, the tag makes sure we built it and it was not altered
+  memcpy(&payload, (const uint8_t *)pkt + LIBNET_ICMPV4_ECHO_H, sizeof(payload));
+  if( !probe_payload_check(st, &payload, &sent_at) || (ntohl(payload.round) != seq) )
+    goto unmatched;
+  
+  target = ntohl(payload.index);
+  if( (target >= st->targets_count) || (st->targets[target].in_addr != from) )
+    goto unmatched;
+  
+  // the slots of a target are only updated by the receiver of its worker,
+  // the socket filter already drops the others on linux
+  if( (target % st->workers_count) != w->shard )
+    goto unmatched;
+  
+  // the kernel sets the id of datagram sockets and did the check already
+  if( !st->dgram && (ntohs(pkt->icmp_id) != target_icmp_id(st, target)) )
+    goto unmatched;
+  
+  // a request from a round no longer in the window
+  reply = &st->replies[ ((uint16_t)(seq - st->first_seq) % st->window) * st->targets_count + target ];
+  if( (reply->seq != seq) || !reply->sent ){
+    COUNTER_ADD(c, late, 1);
+    return 0;
+  }
+  
+  // duplicate
+  if( reply->received )
+    goto unmatched;
+  
+  // the slot may already hold the correction from the kernel send timestamp,
+  // which the first worker can apply at any time
+  rtt = timediff(&sent_at, received_at);
+  
+  if( st->monitoring ){
+    mrb_int total = __atomic_load_n(&reply->rtt, __ATOMIC_RELAXED) + rtt;
+    
+    // too late, it will be counted as lost
+    if( (total < 0) || (total > st->monitor_timeout) ){
+      COUNTER_ADD(c, late, 1);
+      return 0;
+    }
+    
+    latency_stats_add(&st->stats[target], total);
+  }
+    
+  __atomic_fetch_add(&reply->rtt, (int32_t) rtt, __ATOMIC_RELAXED);
+  reply->received = 1;
+  COUNTER_ADD(c, matched, 1);
+  // printf("got reply for %d after %d ms\n", reply->seq, reply->rtt / 1000);
+  
+  if( st->monitoring )
+    return 0;
+  
+  *index = reply - st->replies;
+  return 1;
+
+unmatched:
+  COUNTER_ADD(c, unmatched, 1);
+  return 0;
+}
+
+// add the replies matched by a receiver to the list send_pings waits on,
+// called with the worker's replies_lock held so stop_matching waits for it
+static void publish_matched(struct state *st, const uint32_t *matched, int count)
+{
+  int i;
+  
+  pthread_mutex_lock(&st->lock);
+  
+  // the cycle is ending, its replies are no longer read from the list
+  if( st->cycle_active ){
+    for(i = 0; i< count; i++){
+      st->matched[st->matched_count++] = matched[i];
+    }
+    
+    if( st->streaming || (st->matched_count >= st->expected) )
+      pthread_cond_signal(&st->cycle_cond);
+    
+    notify_caller(st);
+  }
+  
+  pthread_mutex_unlock(&st->lock);
+}
+
+#ifdef HAVE_TX_TIMESTAMPS
+
+// use the time the kernel sent the request as its send time by removing
+// the delay since the time in the payload from the latency, the copy
+// starts with the link layer header so we look for our payload, called by
+// the receiver of the first worker with its replies_lock held, the slot may
+// belong to another worker so the latency is updated atomically
+static void match_sent_request(struct state *st, const uint8_t *packet, size_t len, const struct timespec *sent_at)
+{
+  size_t off;
+  
+  if( !__atomic_load_n(&st->cycle_active, __ATOMIC_ACQUIRE) )
+    return;
+  
+  for(off = 0; off + LIBNET_ICMPV4_ECHO_H + sizeof(struct probe_payload) <= len; off++){
+    struct probe_payload payload;
+    struct ping_reply *reply;
+    struct timespec payload_ts;
+    uint16_t seq;
+    uint32_t target;
+    
+    if( (packet[off] != ICMP_ECHO) || (packet[off + 1] != 0) )
+      continue;
+    
+    memcpy(&payload, packet + off + LIBNET_ICMPV4_ECHO_H, sizeof(payload));
+    if( !probe_payload_check(st, &payload, &payload_ts) )
+      continue;
+    
+    memcpy(&seq, packet + off + 6, sizeof(seq));
+    seq = ntohs(seq);
+    
+    target = ntohl(payload.index);
+    if( target >= st->targets_count )
+      return;
+    
+    reply = &st->replies[ ((uint16_t)(seq - st->first_seq) % st->window) * st->targets_count + target ];
+    if( (reply->seq == seq) && reply->sent ){
+      __atomic_fetch_sub(&reply->rtt, (int32_t) timediff(&payload_ts, sent_at), __ATOMIC_RELAXED);
+    }
+    
+    return;
+  }
+}
+
+// read the send timestamps queued on the error queue of a socket
+static void drain_tx_timestamps(struct worker *w, int sock)
+{
+  struct state *st = w->st;
+  uint8_t packets[RECV_BATCH_SIZE][TX_PACKET_SIZE];
+  uint8_t controls[RECV_BATCH_SIZE][CMSG_SPACE(sizeof(struct scm_timestamping)) + CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in))];
+  struct iovec iovecs[RECV_BATCH_SIZE];
+  struct mmsghdr msgs[RECV_BATCH_SIZE];
+  int c, i, err;
+  socklen_t errlen = sizeof(err);
+  
+  for(i = 0; i< RECV_BATCH_SIZE; i++){
+    iovecs[i].iov_base = packets[i];
+    iovecs[i].iov_len = TX_PACKET_SIZE;
+  }
+  
+  while(1){
+    for(i = 0; i< RECV_BATCH_SIZE; i++){
+      bzero(&msgs[i].msg_hdr, sizeof(msgs[i].msg_hdr));
+      msgs[i].msg_hdr.msg_iov = &iovecs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_control = controls[i];
+      msgs[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+    }
+    
+    c = recvmmsg(sock, msgs, RECV_BATCH_SIZE, MSG_ERRQUEUE | MSG_DONTWAIT, NULL);
+    if( c < 0 ){
+      if( errno == EINTR )
+        continue;
+      
+      if( errno != EAGAIN ){
+        perror("recvmmsg(MSG_ERRQUEUE)");
+      }
+      
+      break;
+    }
+    
+    pthread_mutex_lock(&w->replies_lock);
+    
+    for(i = 0; i< c; i++){
+      struct cmsghdr *cmsg;
+      
+      for(cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)){
+        if( (cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_TIMESTAMPING) ){
+          struct scm_timestamping ts;
+          
+          // ts[0] is the software timestamp
+          memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+          if( timespec_isset(&ts.ts[0]) ){
+            match_sent_request(st, packets[i], msgs[i].msg_len, &ts.ts[0]);
+          }
+        }
+      }
+    }
+    
+    pthread_mutex_unlock(&w->replies_lock);
+    
+    if( c < RECV_BATCH_SIZE )
+      break;
+  }
+  
+  // a pending socket error would keep EPOLLERR set, reading it clears it
+  getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &errlen);
+}
+
+#endif
+
+#ifdef HAVE_RECVMMSG
+
+// read everything available on a capture socket and match the echo replies,
+// packets are read in batches and their reception time comes from the kernel
+// timestamp (SO_TIMESTAMPNS) attached to each of them, the state lock is only
+// taken once per batch to publish the matched replies, returns -1 on fatal error
+static int drain_capture_socket(struct worker *w, int sock)
+{
+  struct state *st = w->st;
+  uint8_t packets[RECV_BATCH_SIZE][RECV_PACKET_SIZE];
+  uint32_t matched[RECV_BATCH_SIZE];
+  uint8_t controls[RECV_BATCH_SIZE][RECV_CONTROL_SIZE];
+  struct sockaddr_in from[RECV_BATCH_SIZE];
+  struct iovec iovecs[RECV_BATCH_SIZE];
+  struct mmsghdr msgs[RECV_BATCH_SIZE];
+  struct timespec started_at;
+  uint32_t drops = 0;
+  int c, i, matched_count, ret = 0;
+  
+  clock_gettime(CLOCK_MONOTONIC, &started_at);
+  
+  for(i = 0; i< RECV_BATCH_SIZE; i++){
+    iovecs[i].iov_base = packets[i];
+    iovecs[i].iov_len = RECV_PACKET_SIZE;
+  }
+  
+  while(1){
+    for(i = 0; i< RECV_BATCH_SIZE; i++){
+      bzero(&msgs[i].msg_hdr, sizeof(msgs[i].msg_hdr));
+      msgs[i].msg_hdr.msg_name = &from[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+      msgs[i].msg_hdr.msg_iov = &iovecs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_control = controls[i];
+      msgs[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+    }
+    
+    c = recvmmsg(sock, msgs, RECV_BATCH_SIZE, MSG_DONTWAIT, NULL);
+    COUNTER_ADD(&w->counters, recv_calls, 1);
+    if( c < 0 ){
+      if( errno == EINTR )
+        continue;
+      
+      if( errno != EAGAIN ){
+        perror("recvmmsg");
+        ret = -1;
+      }
+      
+      break;
+    }
+    
+    COUNTER_ADD(&w->counters, received, c);
+    
+    pthread_mutex_lock(&w->replies_lock);
+    matched_count = 0;
+    
+    for(i = 0; i< c; i++){
+      struct cmsghdr *cmsg;
+      struct timespec received_at = {0, 0};
+      
+      // the drop counter would silently stop updating
+      if( (msgs[i].msg_hdr.msg_flags & MSG_CTRUNC) && !w->control_truncated ){
+        printf("control data truncated on socket %d, kernel drops will be missing\n", sock);
+        w->control_truncated = 1;
+      }
+      
+      for(cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)){
+        if( (cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_TIMESTAMPNS) ){
+          memcpy(&received_at, CMSG_DATA(cmsg), sizeof(received_at));
+        }
+#ifdef SO_RXQ_OVFL
+        // total for the socket, the last one is the most recent
+        else if( (cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SO_RXQ_OVFL) ){
+          memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+        }
+#endif
+      }
+      
+      // no timestamp from the kernel, use the current time
+      if( !timespec_isset(&received_at) ){
+        clock_gettime(CLOCK_REALTIME, &received_at);
+      }
+      
+      // the simulated network has no address, the sender is in the ip header
+      if( st->simulated && (msgs[i].msg_len >= LIBNET_IPV4_H) ){
+        from[i].sin_addr = ((const struct ip *) packets[i])->ip_src;
+      }
+      
+      if( match_echo_reply(w, packets[i], msgs[i].msg_len, from[i].sin_addr.s_addr, &received_at, &matched[matched_count]) )
+        matched_count++;
+    }
+    
+    if( matched_count > 0 )
+      publish_matched(st, matched, matched_count);
+    
+    // the capture sockets only change between cycles
+    if( (drops > 0) && __atomic_load_n(&st->cycle_active, __ATOMIC_ACQUIRE) ){
+      for(i = 0; i< st->capture_sockets_count; i++){
+        if( st->capture_sockets[i].socket == sock )
+          __atomic_store_n(&st->capture_sockets[i].drops, drops, __ATOMIC_RELAXED);
+      }
+    }
+    
+    pthread_mutex_unlock(&w->replies_lock);
+    
+    // the queue was emptied
+    if( c < RECV_BATCH_SIZE )
+      break;
+  }
+  
+  COUNTER_ADD(&w->counters, receive_ns, elapsed_ns(&started_at));
+  
+  return ret;
+}
+
+#else
+
+// read everything available on a capture socket and match the echo replies,
+// returns -1 on fatal error
+static int drain_capture_socket(struct worker *w, int sock)
+{
+  struct state *st = w->st;
+  int c, ret = 0;
+  struct sockaddr_in from;
+  socklen_t fromlen = sizeof(from);
+  struct timespec started_at;
+  
+  clock_gettime(CLOCK_MONOTONIC, &started_at);
+  
+  while(1){
+    uint8_t packet[RECV_PACKET_SIZE];
+    struct timespec received_at;
+    uint32_t index;
+    
+    c = recvfrom(sock, packet, sizeof(packet), 0, (struct sockaddr *) &from, &fromlen);
+    COUNTER_ADD(&w->counters, recv_calls, 1);
+    if( c < 0 ) {
+      if ((errno != EINTR) && (errno != EAGAIN)){
+        perror("recvfrom");
+        ret = -1;
+      }
+      
+      break;
+    }
+    
+    COUNTER_ADD(&w->counters, received, 1);
+    clock_gettime(CLOCK_REALTIME, &received_at);
+    
+    pthread_mutex_lock(&w->replies_lock);
+    if( match_echo_reply(w, packet, c, from.sin_addr.s_addr, &received_at, &index) )
+      publish_matched(st, &index, 1);
+    pthread_mutex_unlock(&w->replies_lock);
+  }
+  
+  COUNTER_ADD(&w->counters, receive_ns, elapsed_ns(&started_at));
+  
+  return ret;
+}
+
+#endif
+
+#ifdef HAVE_EPOLL
+
+static void *thread_icmp_reply_catcher(void *v)
+{
+  struct worker *w = (struct worker *)v;
+  struct epoll_event events[EPOLL_MAX_EVENTS];
+  
+  while ( !w->receiver_stopping ) {
+    int i, ret;
+    
+    ret = epoll_wait(w->epoll_fd, events, EPOLL_MAX_EVENTS, -1);
+    COUNTER_ADD(&w->counters, wakeups, 1);
+    if( ret == -1 ){
+      if( errno == EINTR )
+        continue;
+      
+      perror("epoll_wait");
+      return NULL;
+    }
+    
+    for(i = 0; i< ret; i++){
+      if( events[i].data.fd == w->wakeup_fd ){
+        uint64_t value;
+        
+        // consume the event, the loop condition will tell if we need to stop
+        if( read(w->wakeup_fd, &value, sizeof(value)) == -1 ){
+          perror("read(eventfd)");
+        }
+        
+        continue;
+      }
+      
+#ifdef HAVE_TX_TIMESTAMPS
+      if( events[i].events & EPOLLERR ){
+        drain_tx_timestamps(w, events[i].data.fd);
+      }
+      
+      // the sending libnet sockets only have timestamps to read
+      if( !(events[i].events & EPOLLIN) )
+        continue;
+#endif
+      
+      // sockets are registered in edge triggered mode so they need to be fully drained
+      drain_capture_socket(w, events[i].data.fd);
+    }
+  }
+  
+  return NULL;
+}
+
+#else
+
+static void *thread_icmp_reply_catcher(void *v)
+{
+  struct worker *w = (struct worker *)v;
+  struct state *st = w->st;
+  int ret;
+  fd_set rfds;
+  struct timeval tv;
+  
+  while ( !w->receiver_stopping ) {
+    int i, maxfd = 0;
+    
+    FD_ZERO(&rfds);
+    
+    for(i = 0; i< st->capture_sockets_count; i++){
+      if( st->capture_sockets[i].shard != w->shard )
+        continue;
+      
+      FD_SET(st->capture_sockets[i].socket, &rfds);
+      if( st->capture_sockets[i].socket >= maxfd ){
+        maxfd = st->capture_sockets[i].socket + 1;
+      }
+    }
+    
+    // wake up regularly to check if we should stop
+    fill_timeout(&tv, RECEIVER_POLL_INTERVAL);
+    ret = select(maxfd, &rfds, NULL, NULL, &tv);
+    COUNTER_ADD(&w->counters, wakeups, 1);
+    if( ret == -1 ){
+      if( errno == EINTR )
+        continue;
+      
+      perror("select");
+      return NULL;
+    }
+    
+    if( ret > 0 ){
+      for(i = 0; i< st->capture_sockets_count; i++){
+        int sock = st->capture_sockets[i].socket;
+        
+        if( (st->capture_sockets[i].shard == w->shard) && FD_ISSET(sock, &rfds) ){
+          drain_capture_socket(w, sock);
+        }
+        
+      }
+    }
+  }
+  
+  return NULL;
+}
+
+#endif
+
+// start the receiver threads if they are not already running
+static int start_receiver(struct state *st)
+{
+  int i, ret;
+  
+  for(i = 0; i< st->workers_count; i++){
+    struct worker *w = &st->workers[i];
+    
+    if( w->receiver_started )
+      continue;
+    
+    w->receiver_stopping = 0;
+    ret = pthread_create(&w->receiver, NULL, thread_icmp_reply_catcher, w);
+    if( ret != 0 )
+      return ret;
+    
+    w->receiver_started = 1;
+  }
+  
+  return 0;
+}
+
+static void stop_worker_receiver(struct worker *w)
+{
+  if( !w->receiver_started )
+    return;
+  
+  w->receiver_stopping = 1;
+
+#ifdef HAVE_EPOLL
+  {
+    uint64_t value = 1;
+    
+    if( write(w->wakeup_fd, &value, sizeof(value)) == -1 ){
+      perror("write(eventfd)");
+    }
+  }
+#endif
+  
+  pthread_join(w->receiver, NULL);
+  w->receiver_started = 0;
+}
+
+static void stop_receiver(struct state *st)
+{
+  int i;
+  
+  for(i = 0; i< st->workers_count; i++){
+    stop_worker_receiver(&st->workers[i]);
+  }
+}
+
+// number of threads sending at the same time
+static int pacer_senders(struct state *st)
+{
+  return st->senders_active ? st->workers_count : 1;
+}
+
+// prepare the pacer for a round starting at round_start and lasting window usec,
+// the round starts later if the previous one is not finished yet
+static void pacer_start_round(struct state *st, struct pacer *pacer, const struct timespec *round_start, mrb_int window, uint32_t count)
+{
+  pacer->gap = 0;
+  
+  if( count > 0 ){
+    pacer->gap = (window * 1000) / count;
+  }
+  
+  // each sender thread gets its share of the rate
+  if( (st->max_pps > 0) && (pacer->gap < 1000000000ULL * pacer_senders(st) / st->max_pps) ){
+    pacer->gap = 1000000000ULL * pacer_senders(st) / st->max_pps;
+  }
+  
+  if( timespec_cmp(&pacer->next, round_start) < 0 ){
+    pacer->next = *round_start;
+  }
+}
+
+// wait for the next deadline, return 0 if the wait was interrupted
+static int pacer_wait(struct state *st, struct pacer *pacer)
+{
+  int ret = 1;
+  
+  if( pacer->running != NULL ){
+    pthread_mutex_lock(&st->lock);
+    
+    while( *pacer->running ){
+      if( pthread_cond_timedwait(&st->monitor_cond, &st->lock, &pacer->next) == ETIMEDOUT )
+        break;
+    }
+    
+    ret = *pacer->running;
+    pthread_mutex_unlock(&st->lock);
+  }
+  else {
+    sleep_until(&pacer->next);
+  }
+  
+  return ret;
+}
+
+#ifdef HAVE_SENDMMSG
+
+// send one echo request to each target using the prebuilt templates,
+// requests going through the same socket and whose deadline is reached
+// are sent with one sendmmsg call, only the targets listed in order are used
+static void send_tick_targets(struct state *st, struct counters *counters, const uint32_t *order, uint32_t order_count, struct ping_reply *tick_replies, struct pacer *pacer)
+{
+  struct mmsghdr msgs[SEND_BATCH_SIZE];
+  struct iovec iovecs[SEND_BATCH_SIZE];
+  uint32_t batch[SEND_BATCH_SIZE];
+  uint32_t n = 0;
+  int count = 0;
+  
+  while( n < order_count ){
+    int ret, sent = 0, sock = st->templates[order[n]].socket;
+    struct timespec sent_at, now, started_at;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if( timespec_cmp(&pacer->next, &now) > 0 ){
+      if( !pacer_wait(st, pacer) )
+        return;
+      
+      clock_gettime(CLOCK_MONOTONIC, &now);
+    }
+    
+    // the send time carried by the requests, it is set before sending
+    // so the receiver never sees a reply for a request not yet marked as sent
+    clock_gettime(CLOCK_REALTIME, &sent_at);
+    
+    // fill the batch with targets sharing the same socket
+    clock_gettime(CLOCK_MONOTONIC, &started_at);
+    count = 0;
+    while( (n < order_count) && (count < SEND_BATCH_SIZE) && (st->templates[order[n]].socket == sock) &&
+        (timespec_cmp(&pacer->next, &now) <= 0) ){
+      int target = order[n++];
+      struct probe_template *t = &st->templates[target];
+      
+      timespec_add_nsec(&pacer->next, pacer->gap);
+
+      probe_template_stamp(st, t, target, tick_replies[target].seq, &sent_at);
+      tick_replies[target].sent = 1;
+      tick_replies[target].rtt = 0;
+      
+      // the kernel builds the ip header for datagram sockets
+      if( st->dgram ){
+        iovecs[count].iov_base = t->packet + LIBNET_IPV4_H;
+        iovecs[count].iov_len = sizeof(t->packet) - LIBNET_IPV4_H;
+      }
+      else {
+        iovecs[count].iov_base = t->packet;
+        iovecs[count].iov_len = sizeof(t->packet);
+      }
+      
+      bzero(&msgs[count].msg_hdr, sizeof(msgs[count].msg_hdr));
+      // the simulated sockets are connected
+      if( !st->simulated ){
+        msgs[count].msg_hdr.msg_name = &t->dst;
+        msgs[count].msg_hdr.msg_namelen = sizeof(t->dst);
+      }
+      msgs[count].msg_hdr.msg_iov = &iovecs[count];
+      msgs[count].msg_hdr.msg_iovlen = 1;
+      
+      batch[count++] = target;
+    }
+    
+    COUNTER_ADD(counters, built, count);
+    COUNTER_ADD(counters, build_ns, elapsed_ns(&started_at));
+    
+    clock_gettime(CLOCK_MONOTONIC, &started_at);
+    while( sent < count ){
+      ret = sendmmsg(sock, &msgs[sent], count - sent, 0);
+      if( ret == -1 ){
+        if( errno == EINTR )
+          continue;
+        
+        // skip the packet which failed and send the others
+        perror("sendmmsg");
+        COUNTER_ADD(counters, send_errors, 1);
+        tick_replies[batch[sent]].sent = 0;
+        sent++;
+        continue;
+      }
+      
+      COUNTER_ADD(counters, sent, ret);
+      sent += ret;
+    }
+    
+    COUNTER_ADD(counters, send_ns, elapsed_ns(&started_at));
+  }
+}
+
+// send one echo request to each target
+static void send_tick(struct state *st, struct ping_reply *tick_replies, struct pacer *pacer)
+{
+  send_tick_targets(st, &st->workers[0].counters, st->send_order, st->targets_count, tick_replies, pacer);
+}
+
+// send all the rounds of a send_pings cycle to the targets of one worker,
+// returns the number of requests sent
+static uint32_t send_cycle(struct worker *w)
+{
+  struct state *st = w->st;
+  const uint32_t *order = &st->send_order[w->send_start];
+  struct pacer pacer;
+  uint32_t i, sent = 0;
+  uint16_t j;
+  
+  bzero(&pacer, sizeof(pacer));
+  pacer.running = &st->senders_active;
+  
+  for(j = 0; (j< st->cycle_count) && st->senders_active; j++){
+    struct timespec round_start = st->cycle_started_at;
+    
+    timespec_add_usec(&round_start, j * st->cycle_delay);
+    pacer_start_round(st, &pacer, &round_start, st->cycle_delay, w->send_count);
+    
+    send_tick_targets(st, &w->counters, order, w->send_count, &st->replies[j * st->targets_count], &pacer);
+  }
+  
+  for(j = 0; j< st->cycle_count; j++){
+    for(i = 0; i< w->send_count; i++){
+      if( st->replies[j * st->targets_count + order[i]].sent )
+        sent++;
+    }
+  }
+  
+  return sent;
+}
+
+// wait for the next cycle and send it until the pinger is freed
+static void *thread_icmp_sender(void *v)
+{
+  struct worker *w = (struct worker *)v;
+  struct state *st = w->st;
+  uint32_t sent;
+  
+  pthread_mutex_lock(&st->lock);
+  
+  while(1){
+    while( !st->senders_exiting && (w->sender_cycle == st->senders_cycle) ){
+      pthread_cond_wait(&st->senders_cond, &st->lock);
+    }
+    
+    if( st->senders_exiting )
+      break;
+    
+    w->sender_cycle = st->senders_cycle;
+    pthread_mutex_unlock(&st->lock);
+    
+    sent = send_cycle(w);
+    
+    // the last one tells the caller how many replies to wait for
+    pthread_mutex_lock(&st->lock);
+    st->senders_sent += sent;
+    if( --st->senders_running == 0 ){
+      st->expected = st->senders_sent;
+      pthread_cond_signal(&st->cycle_cond);
+      notify_caller(st);
+    }
+  }
+  
+  pthread_mutex_unlock(&st->lock);
+  
+  return NULL;
+}
+
+#else
+
+// send one echo request to each target, each one at its deadline
+static void send_tick(struct state *st, struct ping_reply *tick_replies, struct pacer *pacer)
+{
+  struct counters *counters = &st->workers[0].counters;
+  int i;
+  
+  for(i = 0; i< st->targets_count; i++){
+    int sending_socket = -1;
+    struct ping_reply *reply = &tick_replies[i];
+    struct probe_payload payload;
+    struct timespec sent_at, started_at;
+    libnet_ptag_t t;
+    libnet_t *l;
+    const char *device = NULL;
+    
+    if( !pacer_wait(st, pacer) )
+      return;
+    
+    timespec_add_nsec(&pacer->next, pacer->gap);
+    clock_gettime(CLOCK_MONOTONIC, &started_at);
+    
+#ifdef SO_BINDTODEVICE
+    device = st->targets[i].device;
+#endif
+    
+    l = find_libnet_context(st, device);
+    if( l == NULL ){
+      printf("fatal error, no context for device '%s', exiting.\n", device);
+      exit(1);
+    }
+    
+    // the send time carried by the request is taken when building it,
+    // the headers left to build only take a few usec
+    clock_gettime(CLOCK_REALTIME, &sent_at);
+    probe_payload_fill(st, &payload, i, reply->seq, &sent_at);
+    
+    t = libnet_build_icmpv4_echo(
+          ICMP_ECHO,                            /* type */
+          0,                                    /* code */
+          0,                                    /* checksum */
+          target_icmp_id(st, i),                /* id */
+          reply->seq,                           /* sequence number */
+          (uint8_t *) &payload,                 /* payload */
+          sizeof(payload),                      /* payload size */
+          l,                                    /* libnet handle */
+          0
+        );
+    
+    if( t == -1 ){
+      printf("Can't build ICMP header: %s\n", libnet_geterror(l));
+      COUNTER_ADD(counters, send_errors, 1);
+      libnet_clear_packet(l);
+      continue;
+    }
+    
+    if( st->targets[i].in_addr_src != 0 ){
+      t = libnet_build_ipv4(
+          /* ip packet length */  LIBNET_IPV4_H + LIBNET_ICMPV4_ECHO_H + sizeof(payload),
+          /* tos */               0,
+          /* id */                libnet_get_prand(LIBNET_PRu16),
+          /* frag */              0,
+          /* ttl */               100,
+          /* protocol */          IPPROTO_ICMP,
+          /* checksum */          0,
+          /* src IP */            st->targets[i].in_addr_src,
+          /* dst IP */            st->targets[i].in_addr,
+          /* payload */           NULL,
+          /* payload size */      0,
+          /* libnet handle */     l,
+          /* libnet ptag */       0
+        );
+      
+    } else {
+      t = libnet_autobuild_ipv4(
+          LIBNET_IPV4_H + LIBNET_ICMPV4_ECHO_H + sizeof(payload), /* length */
+          IPPROTO_ICMP,                         /* protocol */
+          st->targets[i].in_addr,               /* destination IP */
+          l
+        );
+      
+    }
+    
+    if( t == -1 ){
+      printf("Can't build IP header: %s\n", libnet_geterror(l));
+      COUNTER_ADD(counters, send_errors, 1);
+      libnet_clear_packet(l);
+      continue;
+    }
+    
+    COUNTER_ADD(counters, built, 1);
+    COUNTER_ADD(counters, build_ns, elapsed_ns(&started_at));
+    
+    sending_socket = libnet_getfd(l);
+
+    if( sending_socket != -1 ){
+      
+#ifdef SO_RTABLE
+      if( setsockopt(sending_socket, SOL_SOCKET, SO_RTABLE, &st->targets[i].rtable, sizeof(st->targets[i].rtable)) == -1 ){
+        perror("setsockopt(SO_RTABLE) ");
+      }
+#endif
+      
+      // send the icmp packet, it is marked as sent first so the
+      // receiver never sees a reply for a request not yet marked as sent
+      reply->sent = 1;
+      reply->rtt = 0;
+      clock_gettime(CLOCK_MONOTONIC, &started_at);
+      
+      if( libnet_write(l) < 0 ){
+        printf("writing packet failed: %s\n", libnet_geterror(l));
+        COUNTER_ADD(counters, send_errors, 1);
+        reply->sent = 0;
+      }
+      else {
+        COUNTER_ADD(counters, sent, 1);
+      }
+      
+      COUNTER_ADD(counters, send_ns, elapsed_ns(&started_at));
+      libnet_clear_packet(l);
+    }
+  }
+}
+
+#endif
+
+// make sure the replies buffer can hold rows * targets_count entries and reset them,
+// must be called while no cycle is active
+static void reset_replies(mrb_state *mrb, struct state *st, uint16_t rows)
+{
+  uint32_t needed = rows * st->targets_count;
+  
+  if( needed > st->replies_capacity ){
+    if( st->replies == NULL ){
+      st->replies = MALLOC(needed * sizeof(struct ping_reply));
+    }
+    else {
+      st->replies = REALLOC(st->replies, needed * sizeof(struct ping_reply));
+    }
+    
+    if( st->matched == NULL ){
+      st->matched = MALLOC(needed * sizeof(uint32_t));
+    }
+    else {
+      st->matched = REALLOC(st->matched, needed * sizeof(uint32_t));
+    }
+    
+    st->replies_capacity = needed;
+  }
+  
+  if( rows > st->samples_capacity ){
+    if( st->samples == NULL ){
+      st->samples = MALLOC(rows * sizeof(mrb_int));
+    }
+    else {
+      st->samples = REALLOC(st->samples, rows * sizeof(mrb_int));
+    }
+    
+    st->samples_capacity = rows;
+  }
+  
+  bzero(st->replies, needed * sizeof(struct ping_reply));
+  st->matched_count = 0;
+  st->drained = 0;
+  st->expected = needed;
+}
+
+// pass the replies matched since the last call to the block as (id, seq, latency),
+// the lock is not held while the block runs
+static void yield_matched_replies(mrb_state *mrb, struct state *st, mrb_value block, uint32_t *yielded)
+{
+  uint32_t count;
+  int ai = mrb_gc_arena_save(mrb);
+  
+  pthread_mutex_lock(&st->lock);
+  count = st->matched_count;
+  pthread_mutex_unlock(&st->lock);
+  
+  while( *yielded < count ){
+    uint32_t index = st->matched[(*yielded)++];
+    struct ping_reply *reply = &st->replies[index];
+    mrb_value args[3];
+    
+    args[0] = mrb_fixnum_value(target_key(st, index % st->targets_count));
+    args[1] = mrb_fixnum_value(reply->seq);
+    args[2] = mrb_fixnum_value(reply->rtt);
+    
+    mrb_yield_argv(mrb, block, 3, args);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+}
+
+// interrupt the current cycle and wait for the sender threads to be idle
+static void stop_senders(struct state *st)
+{
+#ifdef HAVE_SENDMMSG
+  if( !st->senders_started )
+    return;
+  
+  pthread_mutex_lock(&st->lock);
+  st->senders_active = 0;
+  pthread_cond_broadcast(&st->monitor_cond);
+  
+  // the last sender to finish signals the caller
+  while( st->senders_running > 0 ){
+    pthread_cond_wait(&st->cycle_cond, &st->lock);
+  }
+  
+  pthread_mutex_unlock(&st->lock);
+#endif
+}
+
+// stop the sender threads for good
+static void exit_senders(struct state *st)
+{
+#ifdef HAVE_SENDMMSG
+  int i;
+  
+  if( !st->senders_started )
+    return;
+  
+  stop_senders(st);
+  
+  pthread_mutex_lock(&st->lock);
+  st->senders_exiting = 1;
+  pthread_cond_broadcast(&st->senders_cond);
+  pthread_mutex_unlock(&st->lock);
+  
+  for(i = 0; i< st->workers_count; i++){
+    pthread_join(st->workers[i].sender, NULL);
+  }
+  
+  st->senders_started = 0;
+#endif
+}
+
+#ifdef HAVE_SENDMMSG
+
+// start the sender threads on first use, one per worker
+static int create_senders(struct state *st)
+{
+  int i, ret;
+  
+  if( st->senders_started )
+    return 0;
+  
+  st->senders_exiting = 0;
+  
+  for(i = 0; i< st->workers_count; i++){
+    st->workers[i].sender_cycle = st->senders_cycle;
+    
+    ret = pthread_create(&st->workers[i].sender, NULL, thread_icmp_sender, &st->workers[i]);
+    if( ret != 0 ){
+      int j;
+      
+      pthread_mutex_lock(&st->lock);
+      st->senders_exiting = 1;
+      pthread_cond_broadcast(&st->senders_cond);
+      pthread_mutex_unlock(&st->lock);
+      
+      for(j = 0; j< i; j++){
+        pthread_join(st->workers[j].sender, NULL);
+      }
+      
+      return ret;
+    }
+  }
+  
+  st->senders_started = 1;
+  return 0;
+}
+
+// wake the sender threads for this cycle
+static int start_senders(struct state *st, uint16_t count, mrb_int delay, const struct timespec *started_at)
+{
+  int ret;
+  
+  ret = create_senders(st);
+  if( ret != 0 )
+    return ret;
+  
+  pthread_mutex_lock(&st->lock);
+  st->cycle_count = count;
+  st->cycle_delay = delay;
+  st->cycle_started_at = *started_at;
+  st->senders_sent = 0;
+  st->senders_running = st->workers_count;
+  st->senders_active = 1;
+  st->senders_cycle++;
+  pthread_cond_broadcast(&st->senders_cond);
+  pthread_mutex_unlock(&st->lock);
+  
+  return 0;
+}
+
+#endif
+
+// checks shared by send_pings and start_pings, also makes sure the
+// receivers are running and nothing is left from an interrupted cycle
+static void prepare_cycle(mrb_state *mrb, struct state *st, mrb_int timeout, mrb_int count)
+{
+  int ret;
+  
+  if( timeout <= 0 ) {
+    mrb_raisef(mrb, E_TYPE_ERROR, "timeout should be positive and non null: %d", timeout);
+  }
+  
+  if( (count <= 0) || (count > 0xffff) ){
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "count should be between 1 and 65535: %d", count);
+  }
+  
+  if( st->monitoring ){
+    mrb_raise(mrb, E_RUNTIME_ERROR, "cannot send pings while monitoring");
+  }
+  
+  if( st->async ){
+    mrb_raise(mrb, E_RUNTIME_ERROR, "a cycle started by start_pings is still running");
+  }
+  
+  if( (uint64_t) count * st->targets_count > UINT32_MAX ){
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "too many requests for one call, lower the count");
+  }
+  
+  ret = start_receiver(st);
+  if( ret != 0 ){
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "thread creation failed: %d", ret);
+  }
+  
+  // the previous cycle may have been interrupted by an exception
+  // raised from the block
+  stop_senders(st);
+  stop_matching(st);
+}
+  
+// one row of replies for each round, the receiver threads
+// will start matching replies once the cycle is active
+static void begin_cycle(mrb_state *mrb, struct state *st, uint16_t count, int streaming)
+{
+  uint16_t j;
+  int i;
+  
+  reset_replies(mrb, st, count);
+  
+  for(j = 0; j< count; j++){
+    for(i = 0; i< st->targets_count; i++){
+      st->replies[j * st->targets_count + i].seq = j + 1;
+    }
+  }
+  
+  // the receivers check cycle_active without the state lock
+  pthread_mutex_lock(&st->lock);
+  st->window = count;
+  st->first_seq = 1;
+  st->streaming = streaming;
+  __atomic_store_n(&st->cycle_active, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&st->lock);
+}
+
+// senders still running past the timeout are stopped and
+// the receivers stop matching replies
+static void end_cycle(struct state *st)
+{
+  stop_senders(st);
+  stop_matching(st);
+}
+
+// build the results of the last cycle, count rounds were sent
+static mrb_value cycle_results(mrb_state *mrb, struct state *st, uint16_t count, mrb_value percentiles)
+{
+  mrb_value ret_value;
+  struct timespec started_at;
+  uint16_t j;
+  int i, ai;
+  
+  clock_gettime(CLOCK_MONOTONIC, &started_at);
+  ret_value = mrb_hash_new_capa(mrb, st->targets_count);
+  ai = mrb_gc_arena_save(mrb);
+  
+  for(i = 0; i< st->targets_count; i++){
+    struct latency_stats stats;
+    
+    latency_stats_reset(&stats);
+    
+    for(j = 0; j< count; j++){
+      struct ping_reply *reply = &st->replies[j * st->targets_count + i];
+      mrb_int rtt = -1;
+      
+      if( reply->sent && reply->received ){
+        rtt = reply->rtt;
+        if( rtt < 0 )
+          rtt = 0;
+        
+        st->samples[stats.received] = rtt;
+      }
+      
+      latency_stats_add(&stats, rtt);
+    }
+    
+    mrb_hash_set(mrb, ret_value, mrb_fixnum_value(target_key(st, i)), latency_stats_value(mrb, &stats, st->samples, percentiles));
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  
+  st->aggregate_ns += elapsed_ns(&started_at);
+  
+  return ret_value;
+}
+
+// same as cycle_results but fill the PingResults object kept by the
+// pinger, no ruby value is created for the targets
+static mrb_value cycle_columnar_results(mrb_state *mrb, mrb_value self, struct state *st, uint16_t count)
+{
+  mrb_sym name = mrb_intern_lit(mrb, "@results");
+  mrb_value obj = mrb_iv_get(mrb, self, name);
+  struct ping_results *r;
+  struct timespec started_at;
+  uint16_t j;
+  int i;
+  
+  clock_gettime(CLOCK_MONOTONIC, &started_at);
+  
+  if( mrb_nil_p(obj) ){
+    obj = ping_results_new(mrb);
+    mrb_iv_set(mrb, self, name, obj);
+  }
+  
+  r = ping_results_reset(mrb, obj, st->targets_count, count);
+  
+  for(i = 0; i< st->targets_count; i++){
+    r->keys[i] = target_key(st, i);
+  }
+  
+  for(j = 0; j< count; j++){
+    for(i = 0; i< st->targets_count; i++){
+      struct ping_reply *reply = &st->replies[j * st->targets_count + i];
+      mrb_int rtt = -1;
+      
+      if( reply->sent && reply->received ){
+        rtt = reply->rtt;
+        if( rtt < 0 )
+          rtt = 0;
+      }
+      
+      r->rtts[j * st->targets_count + i] = rtt;
+    }
+  }
+  
+  ping_results_compute(r);
+  
+  st->aggregate_ns += elapsed_ns(&started_at);
+  
+  return obj;
+}
+
+static mrb_value ping_send_pings(mrb_state *mrb, mrb_value self)
+{
+  struct state *st = DATA_PTR(self);
+  mrb_int count, timeout, delay;
+  mrb_value percentiles, block = mrb_nil_value();
+  mrb_bool columnar = 0;
+  int i;
+  uint16_t j;
+  uint32_t sent = 0, yielded = 0;
+  struct timespec started_at, deadline;
+  struct pacer pacer;
+  
+  mrb_get_args(mrb, "iiiA|b&", &timeout, &count, &delay, &percentiles, &columnar, &block);
+  timeout *= 1000; // ms => usec
+  
+  prepare_cycle(mrb, st, timeout, count);
+  begin_cycle(mrb, st, count, !mrb_nil_p(block));
+  
+  clock_gettime(CLOCK_MONOTONIC, &started_at);
+  deadline = started_at;
+  timespec_add_usec(&deadline, timeout);
+  
+#ifdef HAVE_SENDMMSG
+  if( st->workers_count > 1 ){
+    // the workers send to their own targets in parallel
+    i = start_senders(st, count, delay * 1000, &started_at);
+    if( i != 0 ){
+      stop_matching(st);
+      
+      mrb_raisef(mrb, E_RUNTIME_ERROR, "thread creation failed: %d", i);
+    }
+  }
+  else
+#endif
+  {
+    bzero(&pacer, sizeof(pacer));
+    
+    for(j = 0; j< count; j++){
+      struct timespec round_start = started_at;
+      
+      // for each "tick" send one icmp for each defined target, the requests
+      // are spread over the delay and the ticks start delay ms apart
+      timespec_add_usec(&round_start, j * delay * 1000);
+      pacer_start_round(st, &pacer, &round_start, delay * 1000, st->targets_count);
+      
+      send_tick(st, &st->replies[j * st->targets_count], &pacer);
+      
+      if( st->streaming )
+        yield_matched_replies(mrb, st, block, &yielded);
+    }
+    
+    for(i = 0; i< count * st->targets_count; i++){
+      if( st->replies[i].sent )
+        sent++;
+    }
+    
+    pthread_mutex_lock(&st->lock);
+    st->expected = sent;
+    pthread_mutex_unlock(&st->lock);
+  }
   
-  struct state *st = MALLOC(sizeof(struct state));
+  // wait for the remaining replies, there is no need to wait
+  // for the timeout once every request got its reply
+  pthread_mutex_lock(&st->lock);
   
-  st->capture_sockets = NULL;
-  st->capture_sockets_count = 0;
+  while( (st->senders_running > 0) || (st->matched_count < st->expected) ){
+    if( st->streaming && (yielded < st->matched_count) ){
+      pthread_mutex_unlock(&st->lock);
+      yield_matched_replies(mrb, st, block, &yielded);
+      pthread_mutex_lock(&st->lock);
+      continue;
+    }
+    
+    if( pthread_cond_timedwait(&st->cycle_cond, &st->lock, &deadline) == ETIMEDOUT )
+      break;
+  }
   
-  st->targets = NULL;
+  pthread_mutex_unlock(&st->lock);
   
-  st->libnet_contexts = NULL;
-  st->libnet_contexts_count = 0;
+  end_cycle(st);
   
-  DATA_PTR(self)  = (void*)st;
-  DATA_TYPE(self) = &ping_state_type;
+  if( st->streaming )
+    yield_matched_replies(mrb, st, block, &yielded);
+
+  // and process the received replies
+  if( columnar )
+    return cycle_columnar_results(mrb, self, st, count);
   
-  return self;
+  return cycle_results(mrb, st, count, percentiles);
 }
 
-static mrb_value ping_clear_targets(mrb_state *mrb, mrb_value self)
+#if defined(HAVE_EPOLL) && defined(HAVE_SENDMMSG)
+
+// start a cycle sent by the sender threads and return at once, the
+// caller polls the returned descriptor then calls drain and step
+static mrb_value ping_start_pings(mrb_state *mrb, mrb_value self)
 {
   struct state *st = DATA_PTR(self);
+  mrb_int count, timeout, delay;
+  struct timespec started_at;
+  struct itimerspec its;
+  int ret;
+  
+  mrb_get_args(mrb, "iii", &timeout, &count, &delay);
+  timeout *= 1000; // ms => usec
+  
+  prepare_cycle(mrb, st, timeout, count);
   
-  if( st->targets != NULL ){
-    mrb_free(mrb, st->targets);
+  if( init_notify_fd(st) == -1 ){
+    mrb_raise(mrb, E_RUNTIME_ERROR, "cannot create epoll/event/timer descriptors");
   }
   
-  return self;
+  clock_gettime(CLOCK_MONOTONIC, &started_at);
+  st->async_deadline = started_at;
+  timespec_add_usec(&st->async_deadline, timeout);
+  st->async_count = count;
+  
+  // the timer makes the descriptor readable once the timeout is reached
+  bzero(&its, sizeof(its));
+  its.it_value = st->async_deadline;
+  if( timerfd_settime(st->notify_timer_fd, TFD_TIMER_ABSTIME, &its, NULL) == -1 ){
+    mrb_raise(mrb, E_RUNTIME_ERROR, "cannot arm the cycle timer");
+  }
+  
+  clear_notifications(st);
+  
+  pthread_mutex_lock(&st->lock);
+  st->async = 1;
+  pthread_mutex_unlock(&st->lock);
+  
+  begin_cycle(mrb, st, count, 0);
+  
+  ret = start_senders(st, count, delay * 1000, &started_at);
+  if( ret != 0 ){
+    stop_matching(st);
+    
+    pthread_mutex_lock(&st->lock);
+    st->async = 0;
+    pthread_mutex_unlock(&st->lock);
+    
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "thread creation failed: %d", ret);
+  }
+  
+  return mrb_fixnum_value(st->notify_fd);
 }
 
-static mrb_value ping_set_targets(mrb_state *mrb, mrb_value self)
+// return [id, seq, latency] for at most max replies (all if max is 0)
+// matched since the last call
+static mrb_value ping_drain(mrb_state *mrb, mrb_value self)
 {
-  mrb_int n;
-  mrb_value arr;
   struct state *st = DATA_PTR(self);
-  int ai = mrb_gc_arena_save(mrb);
+  mrb_value ret_value;
+  mrb_int max = 0;
+  uint32_t count;
+  int ai;
   
-  mrb_get_args(mrb, "A", &arr);
+  mrb_get_args(mrb, "|i", &max);
   
-  // close existing icmp sockets
-  if( st->capture_sockets != NULL ){
-    FREE(st->capture_sockets);
-    st->capture_sockets = NULL;
-    st->capture_sockets_count = 0;
-  }
-    
-  st->targets_count = RARRAY_LEN(arr);
-  st->targets = MALLOC(sizeof(struct target_address) * st->targets_count );
+  clear_notifications(st);
   
-  for( n = 0; n< st->targets_count; n++ ){
-    mrb_value arr2 = mrb_ary_ref(mrb, arr, n);
-    mrb_value r_addr = mrb_ary_ref(mrb, arr2, 0);
-    mrb_value r_rtable = mrb_ary_ref(mrb, arr2, 1);
-    mrb_value r_uid = mrb_ary_ref(mrb, arr2, 2);
-    mrb_value r_src_addr = mrb_ary_ref(mrb, arr2, 4);
+  pthread_mutex_lock(&st->lock);
+  count = st->matched_count;
+  if( (max > 0) && (count - st->drained > max) ){
+    count = st->drained + max;
     
-#ifdef SO_BINDTODEVICE
-    mrb_value r_ifname = mrb_ary_ref(mrb, arr2, 3);
-#endif
+    // there is more to read, keep the descriptor readable
+    notify_caller(st);
+  }
+  pthread_mutex_unlock(&st->lock);
+  
+  ret_value = mrb_ary_new_capa(mrb, count - st->drained);
+  ai = mrb_gc_arena_save(mrb);
+  
+  while( st->drained < count ){
+    uint32_t index = st->matched[st->drained++];
+    struct ping_reply *reply = &st->replies[index];
+    mrb_value entry = mrb_ary_new_capa(mrb, 3);
     
-    if( !mrb_string_p(r_addr) ){
-      mrb_raisef(mrb, E_TYPE_ERROR, "can't convert %s into String", mrb_obj_classname(mrb, r_addr));
-    }
-    else {
-      const char *device = NULL;
-      
-      st->targets[n].rtable = mrb_fixnum(r_rtable);
-      st->targets[n].in_addr = inet_addr( mrb_str_to_cstr(mrb, r_addr) );
-      
-      if( mrb_nil_p(r_src_addr) ){
-        st->targets[n].in_addr_src = 0;
-      }
-      else {
-        st->targets[n].in_addr_src = inet_addr( mrb_str_to_cstr(mrb, r_src_addr) );
-      }
-      
-      st->targets[n].uid = (uint16_t) mrb_fixnum(r_uid);
-      
-#ifdef SO_BINDTODEVICE
-      bzero(st->targets[n].device, sizeof(st->targets[n].device));
-      
-      if( !mrb_nil_p(r_ifname) ){
-        strncpy(st->targets[n].device, mrb_str_to_cstr(mrb, r_ifname),
-            sizeof(st->targets[n].device) - 1
-          );
-        
-        device = st->targets[n].device;
-      }
-#endif
-      
-      // create capture socket
-      if( init_capture_socket(mrb, st, &st->targets[n]) == -1 ){
-        mrb_raise(mrb, E_RUNTIME_ERROR, "cannot create icmp socket, are you root ?");
-      }
-      
-      // create libnet context
-      if( init_libnet_context(mrb, st, device) == -1 ){
-        mrb_raisef(mrb, E_RUNTIME_ERROR, "cannot create libnet context: %S", mrb_str_new_cstr(mrb, errbuf));
-      }
-    }
+    mrb_ary_push(mrb, entry, mrb_fixnum_value(target_key(st, index % st->targets_count)));
+    mrb_ary_push(mrb, entry, mrb_fixnum_value(reply->seq));
+    mrb_ary_push(mrb, entry, mrb_fixnum_value(reply->rtt));
+    mrb_ary_push(mrb, ret_value, entry);
     
     mrb_gc_arena_restore(mrb, ai);
   }
   
-  return self;
+  return ret_value;
 }
 
-static void fill_timeout(struct timeval *tv, uint64_t duration)
+// return the results once every request got its reply or the
+// timeout is reached, nil before that
+static mrb_value ping_step(mrb_state *mrb, mrb_value self)
 {
-  tv->tv_sec = 0;
-  while( duration >= 1000000 ){
-    duration -= 1000000;
-    tv->tv_sec += 1;
+  struct state *st = DATA_PTR(self);
+  mrb_value percentiles;
+  struct itimerspec its;
+  struct timespec now;
+  int done;
+  
+  mrb_get_args(mrb, "A", &percentiles);
+  
+  if( !st->async ){
+    mrb_raise(mrb, E_RUNTIME_ERROR, "no cycle started with start_pings");
   }
   
-  tv->tv_usec = duration;
+  clear_notifications(st);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  
+  pthread_mutex_lock(&st->lock);
+  done = ((st->senders_running == 0) && (st->matched_count >= st->expected)) || (timespec_cmp(&now, &st->async_deadline) >= 0);
+  pthread_mutex_unlock(&st->lock);
+  
+  if( !done )
+    return mrb_nil_value();
+  
+  end_cycle(st);
+  
+  bzero(&its, sizeof(its));
+  timerfd_settime(st->notify_timer_fd, 0, &its, NULL);
+  
+  pthread_mutex_lock(&st->lock);
+  st->async = 0;
+  pthread_mutex_unlock(&st->lock);
+  
+  return cycle_results(mrb, st, st->async_count, percentiles);
 }
 
-// return t2 - t1 in microseconds
-// static mrb_int timediff(struct timeval *t1, struct timeval *t2)
-// {
-//   return (t2->tv_sec - t1->tv_sec) * 1000000 +
-//   (t2->tv_usec - t1->tv_usec);
-// }
-
+#else
 
-struct ping_reply {
-  uint16_t seq;
-  uint16_t id;
-  in_addr_t addr;
-  struct timeval sent_at, received_at;
-};
+static mrb_value ping_start_pings(mrb_state *mrb, mrb_value self)
+{
+  mrb_raise(mrb, E_RUNTIME_ERROR, "start_pings is not supported on this platform");
+  return self;
+}
 
-struct reply_thread_args {
-  mrb_int           *timeout;
-  struct state      *state;            // read-only
-  struct ping_reply *replies;
-  int               *replies_index;
-};
+static mrb_value ping_drain(mrb_state *mrb, mrb_value self)
+{
+  mrb_raise(mrb, E_RUNTIME_ERROR, "drain is not supported on this platform");
+  return self;
+}
 
-static void *thread_icmp_reply_catcher(void *v)
+static mrb_value ping_step(mrb_state *mrb, mrb_value self)
 {
-  struct reply_thread_args *args = (struct reply_thread_args *)v;
-  int c, ret;
-  fd_set rfds;
-  struct timeval tv, started_at;
-  size_t packet_size;
-  long wait_time = 0; // how much did we already wait
+  mrb_raise(mrb, E_RUNTIME_ERROR, "step is not supported on this platform");
+  return self;
+}
+
+#endif
   
-  // we will receive both the ip header and the icmp data
-  packet_size = LIBNET_IPV4_H + LIBNET_ICMPV4_ECHO_H;
+static void *thread_icmp_monitor(void *v)
+{
+  struct state *st = (struct state *)v;
+  struct timespec next_round;
+  struct pacer pacer;
+  uint32_t round = 0;
+  int i;
+    
+  clock_gettime(CLOCK_MONOTONIC, &next_round);
   
-  gettimeofday(&started_at, NULL);
+  bzero(&pacer, sizeof(pacer));
+  pacer.running = &st->monitoring;
+    
+  pthread_mutex_lock(&st->lock);
   
-  while (1) {
-    int i, maxfd = 0;
-    struct sockaddr_in from;
-    socklen_t fromlen = sizeof(from);
+  while( st->monitoring ){
+    uint16_t seq = round & 0xffff;
+    struct ping_reply *row = &st->replies[(seq % st->window) * st->targets_count];
     
-    FD_ZERO(&rfds);
+    pthread_mutex_unlock(&st->lock);
     
-    for(i = 0; i< args->state->capture_sockets_count; i++){
-      FD_SET(args->state->capture_sockets[i].socket, &rfds);
-      if( args->state->capture_sockets[i].socket >= maxfd ){
-        maxfd = args->state->capture_sockets[i].socket + 1;
+    // this row was used window rounds ago, which is more than the
+    // timeout, requests without reply are now lost
+    lock_replies(st);
+    for(i = 0; i< st->targets_count; i++){
+      if( row[i].sent && !row[i].received ){
+        latency_stats_add(&st->stats[i], -1);
       }
+  
+      bzero(&row[i], sizeof(struct ping_reply));
+      row[i].seq = seq;
     }
+    unlock_replies(st);
     
-    fill_timeout(&tv, *args->timeout - wait_time);
-    ret = select(maxfd, &rfds, NULL, NULL, &tv);
-    if( ret == -1 ){
-      perror("select");
-      return NULL;
-    }
+    // the requests are spread over the interval
+    pacer_start_round(st, &pacer, &next_round, st->monitor_interval, st->targets_count);
+    send_tick(st, row, &pacer);
     
-    if( ret > 0 ){
-      for(i = 0; i< args->state->capture_sockets_count; i++){
-        int sock = args->state->capture_sockets[i].socket;
-        
-        if( FD_ISSET(sock, &rfds) ){
-          while(1){
-            uint8_t packet[sizeof(struct ip) + sizeof(struct icmp)];
-            c = recvfrom(sock, packet, packet_size, 0, (struct sockaddr *) &from, &fromlen);
-            if( c < 0 ) {
-              if ((errno != EINTR) && (errno != EAGAIN)){
-                perror("recvfrom");
-                return NULL;
-              }
-              
-              break;
-            }
-            if (c >= packet_size) {
-              struct ip *iphdr = (struct ip *) packet;
-              struct icmp *pkt = (struct icmp *) (packet + (iphdr->ip_hl << 2));      /* skip ip hdr */
-              
-              if( pkt->icmp_type == ICMP_ECHOREPLY ){
-                int i;
-                
-                // find which reply we just received
-                for(i = 0; i< *args->replies_index; i++){
-                  struct ping_reply *reply = &args->replies[i];
-                  
-                  // same addr, id and sequence id
-                  if( (reply->addr == from.sin_addr.s_addr) && (reply->id == ntohs(pkt->icmp_id)) && (reply->seq == ntohs(pkt->icmp_seq)) ){
-                    gettimeofday(&reply->received_at, NULL);
-                    // printf("got reply for %d after %d ms\n", reply->seq, timediff(&reply->sent_at, &reply->received_at) / 1000);
-                    break;
-                  }
-                }
-                
-              }
-            }
-          }
-        }
-        
-      }
-    }
-    else {
-      // printf("select ret = %d\n", ret);
-    }
+    pthread_mutex_lock(&st->lock);
     
-    {
-      struct timeval now;
-      gettimeofday(&now, NULL);
-      wait_time = (now.tv_sec - started_at.tv_sec) * 1000000;
-      wait_time += (now.tv_usec - started_at.tv_usec);
-      
-      // printf("%d %ld, %d\n", ret, tv.tv_sec, tv.tv_usec);
-    }
+    round++;
+    timespec_add_usec(&next_round, st->monitor_interval);
     
-    if( wait_time >= *args->timeout )
-      break;
-      
+    // the wait is interrupted when monitoring is stopped
+    while( st->monitoring ){
+      if( pthread_cond_timedwait(&st->monitor_cond, &st->lock, &next_round) == ETIMEDOUT )
+        break;
+    }
   }
   
+  st->cycle_active = 0;
+  pthread_mutex_unlock(&st->lock);
+  
   return NULL;
 }
 
-static mrb_value ping_send_pings(mrb_state *mrb, mrb_value self)
+static void stop_monitor(struct state *st)
+{
+  if( !st->monitoring )
+    return;
+  
+  // the replies still in flight must not be taken for a cycle
+  pthread_mutex_lock(&st->lock);
+  st->monitoring = 0;
+  st->cycle_active = 0;
+  pthread_cond_signal(&st->monitor_cond);
+  pthread_mutex_unlock(&st->lock);
+  
+  pthread_join(st->monitor, NULL);
+  stop_matching(st);
+}
+
+static mrb_value ping_start_monitoring(mrb_state *mrb, mrb_value self)
 {
   struct state *st = DATA_PTR(self);
-  mrb_int count, timeout, delay;
-  mrb_value ret_value;
-  int i, ai;
-  uint16_t j;
-    
-  int replies_index = 0;
-  struct ping_reply *replies;
-  struct reply_thread_args thread_args;
-  pthread_t reply_thread;
+  mrb_int interval, timeout;
+  uint16_t window = 2;
+  int ret;
   
-    
-  mrb_get_args(mrb, "iii", &timeout, &count, &delay);
-  timeout *= 1000; // ms => usec
+  mrb_get_args(mrb, "ii", &interval, &timeout);
+  interval *= 1000; // ms => usec
+  timeout *= 1000;
   
-  if( timeout <= 0 ) {
-    mrb_raisef(mrb, E_TYPE_ERROR, "timeout should be positive and non null: %d", timeout);
-    goto error;
+  if( (interval <= 0) || (timeout <= 0) ){
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "interval and timeout should be positive and non null");
   }
   
+  if( st->monitoring ){
+    mrb_raise(mrb, E_RUNTIME_ERROR, "already monitoring");
+  }
   
-  ret_value = mrb_hash_new_capa(mrb, st->targets_count);
+  if( st->async ){
+    mrb_raise(mrb, E_RUNTIME_ERROR, "cannot monitor while a cycle is running");
+  }
   
-  // setup the receiver thread
-  replies = MALLOC(st->targets_count * count * sizeof(struct ping_reply));
-  bzero(replies, st->targets_count * count * sizeof(struct ping_reply));
+  // enough rows for all the rounds which can be in flight, the window
+  // is a power of two so the row stays the same when the sequence wraps
+  while( window * interval <= timeout ){
+    window <<= 1;
+    if( window > MONITOR_MAX_WINDOW ){
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "timeout is too high compared to the interval");
+    }
+  }
   
-  thread_args.state = st;
-  thread_args.replies = replies;
-  thread_args.replies_index = &replies_index;
-  thread_args.timeout = &timeout;
+  if( (uint64_t) window * st->targets_count > UINT32_MAX ){
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "too many targets for this interval and timeout");
+  }
   
-  i = pthread_create(&reply_thread, NULL, thread_icmp_reply_catcher, &thread_args);
-  if( i != 0 ){
-    mrb_raisef(mrb, E_RUNTIME_ERROR, "thread creation failed: %d", i);
-    goto free_replies;
+  ret = start_receiver(st);
+  if( ret != 0 ){
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "thread creation failed: %d", ret);
   }
-  ai = mrb_gc_arena_save(mrb);
   
-
+  reset_replies(mrb, st, window);
   
-  for(j = 0; j< count; j++){
+  if( st->stats != NULL ){
+    FREE(st->stats);
+    st->stats = NULL;
+    st->stats_count = 0;
+  }
+  
+  st->stats = MALLOC(st->targets_count * sizeof(struct latency_stats));
+  bzero(st->stats, st->targets_count * sizeof(struct latency_stats));
+  st->stats_count = st->targets_count;
+  
+  pthread_mutex_lock(&st->lock);
+  st->window = window;
+  st->first_seq = 0;
+  st->monitor_interval = interval;
+  st->monitor_timeout = timeout;
+  st->monitoring = 1;
+  __atomic_store_n(&st->cycle_active, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&st->lock);
+  
+  ret = pthread_create(&st->monitor, NULL, thread_icmp_monitor, st);
+  if( ret != 0 ){
+    pthread_mutex_lock(&st->lock);
+    st->monitoring = 0;
+    pthread_mutex_unlock(&st->lock);
+    stop_matching(st);
     
-    // for each "tick" send one icmp for each defined target
-    // and then sleep
-    for(i = 0; i< st->targets_count; i++){
-      int sending_socket = -1;
-      uint16_t reply_id;
-      mrb_value key, arr;
-      struct ping_reply *reply = &replies[replies_index];
-      libnet_ptag_t t;
-      libnet_t *l;
-      const char *device = NULL;
-      
-#ifdef SO_BINDTODEVICE
-      device = st->targets[i].device;
-#endif
-      
-      l = find_libnet_context(st, device);
-      if( l == NULL ){
-        printf("fatal error, no context for device '%s', exiting.\n", device);
-        exit(1);
-      }
-      
-      reply_id = st->targets[i].uid;
-      if( reply_id == 0 ){
-        reply_id = 100 + i;
-      }
-      
-      key = mrb_fixnum_value(reply_id);
-      arr = mrb_ary_new_capa(mrb, count);
-      mrb_hash_set(mrb, ret_value, key, arr);
-      
-      reply->id = reply_id;
-      reply->seq = j + 1;
-      reply->addr = st->targets[i].in_addr;
-      // printf("saved sent_at for seq %d\n", j);
-
-      mrb_ary_set(mrb, arr, j, mrb_nil_value());
-      
-      
-      t = libnet_build_icmpv4_echo(
-            ICMP_ECHO,                            /* type */
-            0,                                    /* code */
-            0,                                    /* checksum */
-            reply_id,                             /* id */
-            j + 1,                                /* sequence number */
-            NULL,                                 /* payload */
-            0,                                    /* payload size */
-            l,                                    /* libnet handle */
-            0
-          );
-      
-      if( t == -1 ){
-        printf("Can't build ICMP header: %s\n", libnet_geterror(l));
-        goto error;
-      }
-      
-      if( st->targets[i].in_addr_src != 0 ){
-        t = libnet_build_ipv4(
-            /* ip packet length */  LIBNET_IPV4_H + LIBNET_ICMPV4_ECHO_H + 0,
-            /* tos */               0,
-            /* id */                libnet_get_prand(LIBNET_PRu16),
-            /* frag */              0,
-            /* ttl */               100,
-            /* protocol */          IPPROTO_ICMP,
-            /* checksum */          0,
-            /* src IP */            st->targets[i].in_addr_src,
-            /* dst IP */            st->targets[i].in_addr,
-            /* payload */           NULL,
-            /* payload size */      0,
-            /* libnet handle */     l,
-            /* libnet ptag */       0
-          );
-        
-      } else {
-        t = libnet_autobuild_ipv4(
-            LIBNET_IPV4_H + LIBNET_ICMPV4_ECHO_H + 0, /* length */
-            IPPROTO_ICMP,                         /* protocol */
-            st->targets[i].in_addr,               /* destination IP */
-            l
-          );
-        
-      }
-      
-      if( t == -1 ){
-        printf("Can't build IP header: %s\n", libnet_geterror(l));
-        goto error;
-      }
-      
-      
-      sending_socket = libnet_getfd(l);
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "thread creation failed: %d", ret);
+  }
+  
+  return self;
+}
 
-      if( sending_socket != -1 ){
-        
-#ifdef SO_RTABLE
-        if( setsockopt(sending_socket, SOL_SOCKET, SO_RTABLE, &st->targets[i].rtable, sizeof(st->targets[i].rtable)) == -1 ){
-          perror("setsockopt(SO_RTABLE) ");
-        }
-#endif
-        
-        // send the icmp packet
-        replies_index++;
-        
-        if( libnet_write(l) >= 0 ){
-          gettimeofday(&reply->sent_at, NULL);
-        }
-        else {
-          printf("writing packet failed: %s\n", libnet_geterror(l));
-        }
-        
-        libnet_clear_packet(l);
-      }
-      
-      mrb_gc_arena_restore(mrb, ai);
-    }
-    
-    usleep(delay * 1000);
+static mrb_value ping_stop_monitoring(mrb_state *mrb, mrb_value self)
+{
+  struct state *st = DATA_PTR(self);
+  
+  stop_monitor(st);
+  
+  return self;
+}
+
+static mrb_value ping_is_monitoring(mrb_state *mrb, mrb_value self)
+{
+  struct state *st = DATA_PTR(self);
+  
+  return mrb_bool_value(st->monitoring);
+}
+
+static mrb_value ping_set_max_pps(mrb_state *mrb, mrb_value self)
+{
+  struct state *st = DATA_PTR(self);
+  mrb_int pps;
+  
+  mrb_get_args(mrb, "i", &pps);
+  
+  if( pps < 0 ){
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "max_pps should be positive");
   }
   
-  pthread_join(reply_thread, NULL);
+  if( st->monitoring ){
+    mrb_raise(mrb, E_RUNTIME_ERROR, "cannot change max_pps while monitoring");
+  }
   
-  // and process the received replies
-  for(i = 0; i< replies_index; i++){
-    // char *host = inet_ntoa( *((struct in_addr *) &replies[i].addr));
-    mrb_value key, value;
-    mrb_int latency;
+  st->max_pps = pps;
+  
+  return self;
+}
+
+static mrb_value ping_collect(mrb_state *mrb, mrb_value self)
+{
+  struct state *st = DATA_PTR(self);
+  struct latency_stats *stats;
+  struct timespec started_at;
+  mrb_value ret_value;
+  uint32_t count;
+  int i, ai;
+  
+  // the stats are freed when the targets change, until then they
+  // match the targets table
+  if( (st->stats == NULL) || (st->stats_count != st->targets_count) ){
+    return mrb_hash_new(mrb);
+  }
+  
+  clock_gettime(CLOCK_MONOTONIC, &started_at);
+  
+  // take a snapshot of the counters and reset them
+  count = st->stats_count;
+  stats = MALLOC(count * sizeof(struct latency_stats));
+  
+  lock_replies(st);
+  memcpy(stats, st->stats, count * sizeof(struct latency_stats));
+  bzero(st->stats, count * sizeof(struct latency_stats));
+  unlock_replies(st);
+  
+  ret_value = mrb_hash_new_capa(mrb, count);
+  ai = mrb_gc_arena_save(mrb);
+  
+  // no percentiles, the latencies themselves are not kept
+  for(i = 0; i< count; i++){
+    mrb_hash_set(mrb, ret_value, mrb_fixnum_value(target_key(st, i)), latency_stats_value(mrb, &stats[i], NULL, mrb_nil_value()));
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  
+  FREE(stats);
+  
+  st->aggregate_ns += elapsed_ns(&started_at);
+  
+  return ret_value;
+}
+
+// sum the counters of all the workers
+static mrb_value ping_stats(mrb_state *mrb, mrb_value self)
+{
+  struct state *st = DATA_PTR(self);
+  struct counters total;
+  uint64_t drops = 0, sim_drops = 0;
+  mrb_value ret_value = mrb_hash_new_capa(mrb, 15);
+  int i;
+  
+  bzero(&total, sizeof(total));
+  
+  for(i = 0; i< st->workers_count; i++){
+    struct counters *c = &st->workers[i].counters;
     
-    // key = mrb_str_new_cstr(mrb, host);
-    key = mrb_fixnum_value(replies[i].id);
-    value = mrb_hash_get(mrb, ret_value, key);
-    if( mrb_nil_p(value) ){
-      printf("no array with key %d !\n", replies[i].id);
-      goto error;
-    }
+    total.built += __atomic_load_n(&c->built, __ATOMIC_RELAXED);
+    total.sent += __atomic_load_n(&c->sent, __ATOMIC_RELAXED);
+    total.send_errors += __atomic_load_n(&c->send_errors, __ATOMIC_RELAXED);
+    total.recv_calls += __atomic_load_n(&c->recv_calls, __ATOMIC_RELAXED);
+    total.received += __atomic_load_n(&c->received, __ATOMIC_RELAXED);
+    total.matched += __atomic_load_n(&c->matched, __ATOMIC_RELAXED);
+    total.unmatched += __atomic_load_n(&c->unmatched, __ATOMIC_RELAXED);
+    total.late += __atomic_load_n(&c->late, __ATOMIC_RELAXED);
+    total.wakeups += __atomic_load_n(&c->wakeups, __ATOMIC_RELAXED);
+    total.build_ns += __atomic_load_n(&c->build_ns, __ATOMIC_RELAXED);
+    total.send_ns += __atomic_load_n(&c->send_ns, __ATOMIC_RELAXED);
+    total.receive_ns += __atomic_load_n(&c->receive_ns, __ATOMIC_RELAXED);
     
-    if( (replies[i].received_at.tv_sec == 0) && (replies[i].received_at.tv_usec == 0) ){
-      mrb_ary_set(mrb, value, replies[i].seq - 1, mrb_nil_value());
+#ifdef HAVE_SENDMMSG
+    if( st->simulated ){
+      sim_drops += simulator_drops(st->workers[i].sim);
     }
-    else {
-      latency = ((replies[i].received_at.tv_sec - replies[i].sent_at.tv_sec) * 1000000 + (replies[i].received_at.tv_usec - replies[i].sent_at.tv_usec));
-      mrb_ary_set(mrb, value, replies[i].seq - 1, mrb_fixnum_value(latency));
-    }
-    
-    mrb_gc_arena_restore(mrb, ai);
+#endif
   }
   
-free_replies:
-error:
-  FREE(replies);
+  // updated by the receivers, the list itself only changes in this thread
+  for(i = 0; i< st->capture_sockets_count; i++){
+    drops += __atomic_load_n(&st->capture_sockets[i].drops, __ATOMIC_RELAXED);
+  }
+
+#define SET_STAT(NAME, VALUE) mrb_hash_set(mrb, ret_value, mrb_symbol_value(mrb_intern_cstr(mrb, NAME)), mrb_fixnum_value((mrb_int)(VALUE)))
+  SET_STAT("built", total.built);
+  SET_STAT("sent", total.sent);
+  SET_STAT("send_errors", total.send_errors);
+  SET_STAT("recv_calls", total.recv_calls);
+  SET_STAT("received", total.received);
+  SET_STAT("matched", total.matched);
+  SET_STAT("unmatched", total.unmatched);
+  SET_STAT("late", total.late);
+  SET_STAT("wakeups", total.wakeups);
+  SET_STAT("kernel_drops", drops);
+  SET_STAT("simulator_drops", sim_drops);
+  SET_STAT("build_usec", total.build_ns / 1000);
+  SET_STAT("send_usec", total.send_ns / 1000);
+  SET_STAT("receive_usec", total.receive_ns / 1000);
+  SET_STAT("aggregate_usec", st->aggregate_ns / 1000);
+#undef SET_STAT
   
-  // libnet_destroy(l);
   return ret_value;
 }
 
@@ -629,10 +3484,21 @@ void mruby_ping_init_icmp(mrb_state *mrb)
   
   int ai = mrb_gc_arena_save(mrb);
   
-  mrb_define_method(mrb, class, "internal_init", ping_initialize,  MRB_ARGS_NONE());
+  mrb_define_method(mrb, class, "internal_init", ping_initialize,  MRB_ARGS_OPT(4));
   mrb_define_method(mrb, class, "_clear_targets", ping_clear_targets,  MRB_ARGS_NONE());
   mrb_define_method(mrb, class, "_set_targets", ping_set_targets,  MRB_ARGS_REQ(1));
-  mrb_define_method(mrb, class, "_send_pings", ping_send_pings,  MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, class, "_add_targets", ping_add_targets,  MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, class, "_remove_targets", ping_remove_targets,  MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, class, "_send_pings", ping_send_pings,  MRB_ARGS_REQ(4) | MRB_ARGS_OPT(1) | MRB_ARGS_BLOCK());
+  mrb_define_method(mrb, class, "_start_pings", ping_start_pings,  MRB_ARGS_REQ(3));
+  mrb_define_method(mrb, class, "_drain", ping_drain,  MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, class, "_step", ping_step,  MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, class, "_start_monitoring", ping_start_monitoring,  MRB_ARGS_REQ(2));
+  mrb_define_method(mrb, class, "stop_monitoring", ping_stop_monitoring,  MRB_ARGS_NONE());
+  mrb_define_method(mrb, class, "monitoring?", ping_is_monitoring,  MRB_ARGS_NONE());
+  mrb_define_method(mrb, class, "_collect", ping_collect,  MRB_ARGS_NONE());
+  mrb_define_method(mrb, class, "_set_max_pps", ping_set_max_pps,  MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, class, "_stats", ping_stats,  MRB_ARGS_NONE());
     
   mrb_gc_arena_restore(mrb, ai);
 }
@@ -1,9 +1,11 @@
 #include "mruby-ping.h"
 
+#include <strings.h> // bzero
 
 
 
-void ping_set_targets_common(mrb_state *mrb, mrb_value arr, const uint16_t *targets_count, struct target_address *targets)
+
+void ping_set_targets_common(mrb_state *mrb, mrb_value arr, const uint32_t *targets_count, struct target_address *targets)
 {
   int i;
   mrb_value obj;
@@ -17,8 +19,79 @@ void ping_set_targets_common(mrb_state *mrb, mrb_value arr, const uint16_t *targ
   }
 }
 
+// [min_delay, max_delay, jitter, loss, reorder, seed], delays in usec
+void parse_simulator_config(mrb_state *mrb, mrb_value arr, struct simulator_config *config)
+{
+  if( !mrb_array_p(arr) || (RARRAY_LEN(arr) != 6) ){
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "simulation should be [min_delay, max_delay, jitter, loss, reorder, seed]");
+  }
+  
+  // the pinger sets what is not given here
+  bzero(config, sizeof(struct simulator_config));
+  config->min_delay = mrb_fixnum(mrb_to_int(mrb, mrb_ary_ref(mrb, arr, 0)));
+  config->max_delay = mrb_fixnum(mrb_to_int(mrb, mrb_ary_ref(mrb, arr, 1)));
+  config->jitter = mrb_fixnum(mrb_to_int(mrb, mrb_ary_ref(mrb, arr, 2)));
+  config->loss = mrb_float(mrb_to_flo(mrb, mrb_ary_ref(mrb, arr, 3)));
+  config->reorder = mrb_float(mrb_to_flo(mrb, mrb_ary_ref(mrb, arr, 4)));
+  config->seed = (uint32_t) mrb_fixnum(mrb_to_int(mrb, mrb_ary_ref(mrb, arr, 5)));
+  
+  if( (config->min_delay < 0) || (config->max_delay < config->min_delay) || (config->jitter < 0) ){
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "simulated delays should verify 0 <= min_delay <= max_delay and jitter >= 0");
+  }
+  
+  if( (config->loss < 0) || (config->loss > 1) || (config->reorder < 0) || (config->reorder > 1) ){
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "simulated loss and reorder should be between 0 and 1");
+  }
+}
+
+// return t2 - t1 in microseconds
+mrb_int timediff(const struct timespec *t1, const struct timespec *t2)
+{
+  return (t2->tv_sec - t1->tv_sec) * 1000000 +
+  (t2->tv_nsec - t1->tv_nsec) / 1000;
+}
+
+int timespec_isset(const struct timespec *t)
+{
+  return (t->tv_sec != 0) || (t->tv_nsec != 0);
+}
+
+void timespec_add_usec(struct timespec *t, mrb_int usec)
+{
+  t->tv_sec += usec / 1000000;
+  t->tv_nsec += (usec % 1000000) * 1000;
+  
+  if( t->tv_nsec >= 1000000000 ){
+    t->tv_nsec -= 1000000000;
+    t->tv_sec += 1;
+  }
+}
+
+void timespec_add_nsec(struct timespec *t, uint64_t nsec)
+{
+  t->tv_sec += nsec / 1000000000;
+  t->tv_nsec += nsec % 1000000000;
+  
+  if( t->tv_nsec >= 1000000000 ){
+    t->tv_nsec -= 1000000000;
+    t->tv_sec += 1;
+  }
+}
+
+int timespec_cmp(const struct timespec *t1, const struct timespec *t2)
+{
+  if( t1->tv_sec != t2->tv_sec )
+    return (t1->tv_sec < t2->tv_sec) ? -1 : 1;
+  
+  if( t1->tv_nsec != t2->tv_nsec )
+    return (t1->tv_nsec < t2->tv_nsec) ? -1 : 1;
+  
+  return 0;
+}
+
 void mrb_mruby_ping_gem_init(mrb_state *mrb)
 {
+  mruby_ping_init_results(mrb);
   mruby_ping_init_icmp(mrb);
   mruby_ping_init_arp(mrb);
 }
@@ -4,6 +4,7 @@
 #include "mruby/array.h"
 #include "mruby/string.h"
 #include "mruby/hash.h"
+#include "mruby/variable.h"
 
 // #include <stdio.h>
 // #include <stdlib.h>
@@ -11,6 +12,7 @@
 #include <string.h>
 #include <netdb.h>
 #include <errno.h>
+#include <time.h>
 
 #include <sys/socket.h>
 #include <arpa/inet.h>
@@ -21,15 +23,84 @@ struct target_address {
   in_addr_t in_addr_src;
   uint32_t  rtable;
   uint16_t  uid;
+  uint32_t  key;        // icmp, given when added and kept when others are removed
 
 //#ifdef SO_BINDTODEVICE
   char      device[IFNAMSIZ];
 //#endif
 };
 
+// latency statistics of a series of requests, computed in one pass (stats.c)
+struct latency_stats {
+  uint32_t  sent;
+  uint32_t  received;
+  mrb_int   min;
+  mrb_int   max;
+  mrb_int   last;
+  double    mean;
+  double    m2;
+  double    jitter_sum;
+};
+
+// columnar results of a cycle (results.c), rtts holds rounds rows of
+// targets_count latencies in usec, -1 when no reply came back
+struct ping_results {
+  uint32_t  targets_count;
+  uint16_t  rounds;
+  mrb_int   *keys;
+  mrb_int   *rtts;
+  struct latency_stats *stats;
+  mrb_int   *samples;
+  
+  uint32_t  targets_capacity;
+  uint32_t  rtts_capacity;
+  uint16_t  samples_capacity;
+};
+
+// simulated network answering echo requests (simulator.c, linux only),
+// delays are in usec and each target gets a base latency between
+// min_delay and max_delay, loss and reorder are probabilities
+struct simulator_config {
+  mrb_int   min_delay;
+  mrb_int   max_delay;
+  mrb_int   jitter;
+  double    loss;
+  double    reorder;
+  uint32_t  seed;
+  int       arp;        // answer arp requests (ethernet frames) instead
+};
+
+struct simulator;
+
 // shared
-void ping_set_targets_common(mrb_state *mrb, mrb_value arr, const uint16_t *targets_count, struct target_address *targets);
+void ping_set_targets_common(mrb_state *mrb, mrb_value arr, const uint32_t *targets_count, struct target_address *targets);
+void parse_simulator_config(mrb_state *mrb, mrb_value arr, struct simulator_config *config);
+
+// time
+mrb_int timediff(const struct timespec *t1, const struct timespec *t2);
+int timespec_isset(const struct timespec *t);
+void timespec_add_usec(struct timespec *t, mrb_int usec);
+void timespec_add_nsec(struct timespec *t, uint64_t nsec);
+int timespec_cmp(const struct timespec *t1, const struct timespec *t2);
+
+// stats
+void latency_stats_reset(struct latency_stats *s);
+void latency_stats_add(struct latency_stats *s, mrb_int rtt);
+double latency_percentile(mrb_int *values, uint32_t count, double p);
+mrb_value latency_stats_value(mrb_state *mrb, struct latency_stats *s, mrb_int *samples, mrb_value percentiles);
+
+// results
+mrb_value ping_results_new(mrb_state *mrb);
+struct ping_results *ping_results_reset(mrb_state *mrb, mrb_value obj, uint32_t targets_count, uint16_t rounds);
+void ping_results_compute(struct ping_results *r);
+
+// simulator
+struct simulator *simulator_start(const struct simulator_config *config, uint32_t stream, int *request_fd, int *reply_fd);
+void simulator_stop(struct simulator *sim);
+void simulator_set_queue(struct simulator *sim, uint32_t packets);
+uint64_t simulator_drops(struct simulator *sim);
 
 // init
 void mruby_ping_init_icmp(mrb_state *);
 void mruby_ping_init_arp(mrb_state *);
+void mruby_ping_init_results(mrb_state *);
@@ -0,0 +1,242 @@
+#include "mruby-ping.h"
+
+#include <strings.h> // bzero
+
+
+static void ping_results_free(mrb_state *mrb, void *ptr)
+{
+  struct ping_results *r = (struct ping_results *)ptr;
+  
+  if( r->keys != NULL )
+    mrb_free(mrb, r->keys);
+  
+  if( r->rtts != NULL )
+    mrb_free(mrb, r->rtts);
+  
+  if( r->stats != NULL )
+    mrb_free(mrb, r->stats);
+  
+  if( r->samples != NULL )
+    mrb_free(mrb, r->samples);
+  
+  mrb_free(mrb, r);
+}
+
+static struct mrb_data_type ping_results_type = { "PingResults", ping_results_free };
+
+// create an empty result object, the buffers are allocated by ping_results_reset
+mrb_value ping_results_new(mrb_state *mrb)
+{
+  struct ping_results *r = mrb_malloc(mrb, sizeof(struct ping_results));
+  
+  bzero(r, sizeof(struct ping_results));
+  
+  return mrb_obj_value(Data_Wrap_Struct(mrb, mrb_class_get(mrb, "PingResults"), &ping_results_type, r));
+}
+
+// make room for rounds rows of targets_count latencies, the buffers
+// only grow so a pinger reusing the same object stops allocating
+// after its first cycle
+struct ping_results *ping_results_reset(mrb_state *mrb, mrb_value obj, uint32_t targets_count, uint16_t rounds)
+{
+  struct ping_results *r = DATA_PTR(obj);
+  uint32_t needed = targets_count * rounds;
+  
+  if( targets_count > r->targets_capacity ){
+    r->keys = mrb_realloc(mrb, r->keys, targets_count * sizeof(mrb_int));
+    r->stats = mrb_realloc(mrb, r->stats, targets_count * sizeof(struct latency_stats));
+    r->targets_capacity = targets_count;
+  }
+  
+  if( needed > r->rtts_capacity ){
+    r->rtts = mrb_realloc(mrb, r->rtts, needed * sizeof(mrb_int));
+    r->rtts_capacity = needed;
+  }
+  
+  if( rounds > r->samples_capacity ){
+    r->samples = mrb_realloc(mrb, r->samples, rounds * sizeof(mrb_int));
+    r->samples_capacity = rounds;
+  }
+  
+  r->targets_count = targets_count;
+  r->rounds = rounds;
+  
+  return r;
+}
+
+// compute the statistics of each target once the latencies are filled
+void ping_results_compute(struct ping_results *r)
+{
+  uint32_t i;
+  uint16_t j;
+  
+  for(i = 0; i< r->targets_count; i++){
+    latency_stats_reset(&r->stats[i]);
+    
+    for(j = 0; j< r->rounds; j++){
+      latency_stats_add(&r->stats[i], r->rtts[j * r->targets_count + i]);
+    }
+  }
+}
+
+static uint32_t get_target_index(mrb_state *mrb, struct ping_results *r, mrb_int index)
+{
+  if( (index < 0) || (index >= r->targets_count) ){
+    mrb_raisef(mrb, E_INDEX_ERROR, "target index out of range: %S", mrb_fixnum_value(index));
+  }
+  
+  return index;
+}
+
+// same array as send_pings for one target, the latencies of the
+// target are copied in samples for the percentiles
+static mrb_value target_stats_value(mrb_state *mrb, struct ping_results *r, uint32_t i, mrb_value percentiles)
+{
+  uint32_t n = 0;
+  uint16_t j;
+  
+  if( !mrb_nil_p(percentiles) ){
+    for(j = 0; j< r->rounds; j++){
+      mrb_int rtt = r->rtts[j * r->targets_count + i];
+      
+      if( rtt >= 0 )
+        r->samples[n++] = rtt;
+    }
+  }
+  
+  return latency_stats_value(mrb, &r->stats[i], r->samples, percentiles);
+}
+
+static mrb_value ping_results_size(mrb_state *mrb, mrb_value self)
+{
+  struct ping_results *r = DATA_PTR(self);
+  
+  return mrb_fixnum_value(r->targets_count);
+}
+
+static mrb_value ping_results_rounds(mrb_state *mrb, mrb_value self)
+{
+  struct ping_results *r = DATA_PTR(self);
+  
+  return mrb_fixnum_value(r->rounds);
+}
+
+static mrb_value ping_results_id(mrb_state *mrb, mrb_value self)
+{
+  struct ping_results *r = DATA_PTR(self);
+  mrb_int index;
+  
+  mrb_get_args(mrb, "i", &index);
+  
+  return mrb_fixnum_value(r->keys[get_target_index(mrb, r, index)]);
+}
+
+// latency in usec of one request, nil if it was lost
+static mrb_value ping_results_rtt(mrb_state *mrb, mrb_value self)
+{
+  struct ping_results *r = DATA_PTR(self);
+  mrb_int index, round;
+  mrb_int rtt;
+  
+  mrb_get_args(mrb, "ii", &index, &round);
+  
+  if( (round < 0) || (round >= r->rounds) ){
+    mrb_raisef(mrb, E_INDEX_ERROR, "round out of range: %S", mrb_fixnum_value(round));
+  }
+  
+  rtt = r->rtts[round * r->targets_count + get_target_index(mrb, r, index)];
+  
+  return (rtt < 0) ? mrb_nil_value() : mrb_fixnum_value(rtt);
+}
+
+static mrb_value ping_results_loss(mrb_state *mrb, mrb_value self)
+{
+  struct ping_results *r = DATA_PTR(self);
+  struct latency_stats *s;
+  mrb_int index;
+  
+  mrb_get_args(mrb, "i", &index);
+  
+  s = &r->stats[get_target_index(mrb, r, index)];
+  if( s->sent == 0 )
+    return mrb_nil_value();
+  
+  return mrb_float_value(mrb, 100.0 * (s->sent - s->received) / s->sent);
+}
+
+static mrb_value ping_results_average(mrb_state *mrb, mrb_value self)
+{
+  struct ping_results *r = DATA_PTR(self);
+  struct latency_stats *s;
+  mrb_int index;
+  
+  mrb_get_args(mrb, "i", &index);
+  
+  s = &r->stats[get_target_index(mrb, r, index)];
+  if( s->received == 0 )
+    return mrb_nil_value();
+  
+  return mrb_fixnum_value((mrb_int) (s->mean + 0.5));
+}
+
+static mrb_value ping_results_stats(mrb_state *mrb, mrb_value self)
+{
+  struct ping_results *r = DATA_PTR(self);
+  mrb_value percentiles = mrb_nil_value();
+  mrb_int index;
+  
+  mrb_get_args(mrb, "i|A", &index, &percentiles);
+  
+  return target_stats_value(mrb, r, get_target_index(mrb, r, index), percentiles);
+}
+
+// yield (id, stats) for each target, the values of one target
+// are released before building the next ones
+static mrb_value ping_results_each(mrb_state *mrb, mrb_value self)
+{
+  struct ping_results *r = DATA_PTR(self);
+  mrb_value percentiles = mrb_nil_value(), block;
+  uint32_t i;
+  int ai;
+  
+  mrb_get_args(mrb, "|A&", &percentiles, &block);
+  
+  if( mrb_nil_p(block) ){
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "no block given");
+  }
+  
+  ai = mrb_gc_arena_save(mrb);
+  
+  for(i = 0; i< r->targets_count; i++){
+    mrb_value args[2];
+    
+    args[0] = mrb_fixnum_value(r->keys[i]);
+    args[1] = target_stats_value(mrb, r, i, percentiles);
+    
+    mrb_yield_argv(mrb, block, 2, args);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  
+  return self;
+}
+
+void mruby_ping_init_results(mrb_state *mrb)
+{
+  struct RClass *class = mrb_define_class(mrb, "PingResults", mrb->object_class);
+  
+  int ai = mrb_gc_arena_save(mrb);
+  
+  // only created by the pingers
+  mrb_undef_class_method(mrb, class, "new");
+  
+  mrb_define_method(mrb, class, "size", ping_results_size,  MRB_ARGS_NONE());
+  mrb_define_method(mrb, class, "rounds", ping_results_rounds,  MRB_ARGS_NONE());
+  mrb_define_method(mrb, class, "id", ping_results_id,  MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, class, "rtt", ping_results_rtt,  MRB_ARGS_REQ(2));
+  mrb_define_method(mrb, class, "loss", ping_results_loss,  MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, class, "average", ping_results_average,  MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, class, "stats", ping_results_stats,  MRB_ARGS_REQ(1) | MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, class, "each", ping_results_each,  MRB_ARGS_OPT(1) | MRB_ARGS_BLOCK());
+  
+  mrb_gc_arena_restore(mrb, ai);
+}
@@ -0,0 +1,446 @@
+// ppoll (glibc)
+#define _GNU_SOURCE
+
+#include "mruby-ping.h"
+
+#ifdef __linux__
+
+#include <sys/socket.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <strings.h> // bzero
+#include <limits.h>
+
+#include <netinet/in_systm.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <net/ethernet.h>
+#include <netinet/if_ether.h>
+
+// the requests and replies are ip packets (header with options, icmp echo
+// header and payload) or ethernet frames with an arp message
+#define SIM_PACKET_SIZE 128
+
+// how often the thread checks if it should stop (in nsec)
+#define SIM_POLL_INTERVAL 100000000
+
+// kernel memory taken by one queued packet (data and skb overhead) and
+// the smallest queue we ask for, in packets
+#define SIM_PACKET_TRUESIZE 1024
+#define SIM_MIN_QUEUE 1024
+
+struct pending_reply {
+  struct timespec due;
+  uint16_t        len;
+  uint8_t         packet[SIM_PACKET_SIZE];
+};
+
+struct simulator {
+  struct simulator_config config;
+  
+  // requests[0] and replies[0] are given to the pinger
+  int requests[2];
+  int replies[2];
+  
+  pthread_t thread;
+  volatile int running;
+  uint64_t rng;
+  
+  // replies dropped because the queue of the pinger was full
+  uint64_t dropped;
+  
+  // replies waiting to be sent, min heap on due
+  struct pending_reply *heap;
+  uint32_t heap_count;
+  uint32_t heap_capacity;
+};
+
+
+// xorshift64*
+static uint64_t sim_random(struct simulator *sim)
+{
+  sim->rng ^= sim->rng >> 12;
+  sim->rng ^= sim->rng << 25;
+  sim->rng ^= sim->rng >> 27;
+  
+  return sim->rng * 2685821657736338717ULL;
+}
+
+// uniform in [0, 1[
+static double sim_random_double(struct simulator *sim)
+{
+  return (sim_random(sim) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// each target has its own base latency, derived from its address so
+// it does not change between runs with the same seed (splitmix64)
+static mrb_int target_base_delay(const struct simulator *sim, in_addr_t addr)
+{
+  uint64_t z = ((uint64_t)sim->config.seed << 32) ^ addr;
+  mrb_int range = sim->config.max_delay - sim->config.min_delay;
+  
+  z += 0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  z ^= z >> 31;
+  
+  if( range <= 0 )
+    return sim->config.min_delay;
+  
+  return sim->config.min_delay + (mrb_int)(z % (uint64_t)(range + 1));
+}
+
+static void heap_push(struct simulator *sim, const struct pending_reply *r)
+{
+  uint32_t i;
+  
+  if( sim->heap_count == sim->heap_capacity ){
+    struct pending_reply *heap;
+    uint32_t capacity = sim->heap_capacity ? sim->heap_capacity * 2 : 256;
+    
+    heap = realloc(sim->heap, capacity * sizeof(struct pending_reply));
+    if( heap == NULL ){
+      perror("realloc");
+      return;
+    }
+    
+    sim->heap = heap;
+    sim->heap_capacity = capacity;
+  }
+  
+  i = sim->heap_count++;
+  while( i > 0 ){
+    uint32_t parent = (i - 1) / 2;
+    
+    if( timespec_cmp(&r->due, &sim->heap[parent].due) >= 0 )
+      break;
+    
+    sim->heap[i] = sim->heap[parent];
+    i = parent;
+  }
+  
+  sim->heap[i] = *r;
+}
+
+static void heap_pop(struct simulator *sim)
+{
+  struct pending_reply last;
+  uint32_t i = 0;
+  
+  last = sim->heap[--sim->heap_count];
+  
+  while( 2 * i + 1 < sim->heap_count ){
+    uint32_t child = 2 * i + 1;
+    
+    if( (child + 1 < sim->heap_count) && (timespec_cmp(&sim->heap[child + 1].due, &sim->heap[child].due) < 0) )
+      child++;
+    
+    if( timespec_cmp(&sim->heap[child].due, &last.due) >= 0 )
+      break;
+    
+    sim->heap[i] = sim->heap[child];
+    i = child;
+  }
+  
+  if( sim->heap_count > 0 )
+    sim->heap[i] = last;
+}
+
+static uint16_t icmp_checksum(const uint8_t *data, size_t len)
+{
+  uint32_t sum = 0;
+  
+  while( len > 1 ){
+    sum += (data[0] << 8) | data[1];
+    data += 2;
+    len -= 2;
+  }
+  
+  if( len == 1 ){
+    sum += data[0] << 8;
+  }
+  
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+  
+  return htons(~sum);
+}
+
+// decide if the reply of target is lost and when it arrives, return 0
+// if it is lost
+static int reply_delay(struct simulator *sim, in_addr_t target, mrb_int *delay)
+{
+  if( sim_random_double(sim) < sim->config.loss )
+    return 0;
+  
+  *delay = target_base_delay(sim, target);
+  if( sim->config.jitter > 0 ){
+    *delay += (mrb_int)((sim_random_double(sim) * 2 - 1) * sim->config.jitter);
+  }
+  
+  // held back long enough to arrive after the next replies
+  if( sim_random_double(sim) < sim->config.reorder ){
+    *delay += sim->config.max_delay + sim->config.jitter;
+  }
+  
+  if( *delay < 0 )
+    *delay = 0;
+  
+  return 1;
+}
+
+// queue the reply to be sent delay usec from now
+static void push_reply(struct simulator *sim, struct pending_reply *r, mrb_int delay)
+{
+  clock_gettime(CLOCK_MONOTONIC, &r->due);
+  timespec_add_usec(&r->due, delay);
+  
+  heap_push(sim, r);
+}
+
+// turn an echo request into the reply the target would send and
+// decide when (and if) it arrives
+static void schedule_echo_reply(struct simulator *sim, const uint8_t *packet, size_t len)
+{
+  struct pending_reply r;
+  struct ip *iphdr = (struct ip *) r.packet;
+  struct icmp *pkt;
+  in_addr_t target;
+  mrb_int delay;
+  size_t hlen;
+  
+  if( (len < sizeof(struct ip)) || (len > SIM_PACKET_SIZE) )
+    return;
+  
+  memcpy(r.packet, packet, len);
+  r.len = len;
+  
+  hlen = iphdr->ip_hl << 2;
+  if( (iphdr->ip_p != IPPROTO_ICMP) || (len < hlen + ICMP_MINLEN) )
+    return;
+  
+  pkt = (struct icmp *)(r.packet + hlen);
+  if( pkt->icmp_type != ICMP_ECHO )
+    return;
+  
+  target = iphdr->ip_dst.s_addr;
+  
+  if( !reply_delay(sim, target, &delay) )
+    return;
+  
+  iphdr->ip_dst = iphdr->ip_src;
+  iphdr->ip_src.s_addr = target;
+  iphdr->ip_ttl = 64;
+  
+  pkt->icmp_type = ICMP_ECHOREPLY;
+  pkt->icmp_cksum = 0;
+  pkt->icmp_cksum = icmp_checksum((const uint8_t *) pkt, len - hlen);
+  
+  push_reply(sim, &r, delay);
+}
+
+// answer an arp request for target, the mac address of each target is
+// 02:00 followed by its ip address
+static void schedule_arp_reply(struct simulator *sim, const uint8_t *packet, size_t len)
+{
+  struct pending_reply r;
+  struct ether_header *eth = (struct ether_header *) r.packet;
+  struct ether_arp *arp = (struct ether_arp *)(r.packet + sizeof(struct ether_header));
+  uint8_t mac[ETH_ALEN] = { 0x02, 0x00 };
+  in_addr_t target;
+  mrb_int delay;
+  
+  if( (len < sizeof(struct ether_header) + sizeof(struct ether_arp)) || (len > SIM_PACKET_SIZE) )
+    return;
+  
+  memcpy(r.packet, packet, len);
+  r.len = len;
+  
+  if( (ntohs(eth->ether_type) != ETHERTYPE_ARP) || (ntohs(arp->ea_hdr.ar_op) != ARPOP_REQUEST) )
+    return;
+  
+  memcpy(&target, arp->arp_tpa, 4);
+  memcpy(mac + 2, &target, 4);
+  
+  if( !reply_delay(sim, target, &delay) )
+    return;
+  
+  memcpy(eth->ether_dhost, arp->arp_sha, ETH_ALEN);
+  memcpy(eth->ether_shost, mac, ETH_ALEN);
+  
+  arp->ea_hdr.ar_op = htons(ARPOP_REPLY);
+  memcpy(arp->arp_tha, arp->arp_sha, ETH_ALEN);
+  memcpy(arp->arp_tpa, arp->arp_spa, 4);
+  memcpy(arp->arp_sha, mac, ETH_ALEN);
+  memcpy(arp->arp_spa, &target, 4);
+  
+  push_reply(sim, &r, delay);
+}
+
+static void schedule_reply(struct simulator *sim, const uint8_t *packet, size_t len)
+{
+  if( sim->config.arp ){
+    schedule_arp_reply(sim, packet, len);
+  }
+  else {
+    schedule_echo_reply(sim, packet, len);
+  }
+}
+
+static void *thread_simulator(void *v)
+{
+  struct simulator *sim = (struct simulator *)v;
+  struct pollfd pfd;
+  
+  pfd.fd = sim->requests[1];
+  pfd.events = POLLIN;
+  
+  while( sim->running ){
+    struct timespec now, timeout = { 0, SIM_POLL_INTERVAL };
+    uint8_t packet[SIM_PACKET_SIZE];
+    ssize_t len;
+    
+    // sleep until the next reply is due
+    if( sim->heap_count > 0 ){
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      
+      if( timespec_cmp(&now, &sim->heap[0].due) >= 0 ){
+        timeout.tv_nsec = 0;
+      }
+      else if( (sim->heap[0].due.tv_sec - now.tv_sec) * 1000000000LL + (sim->heap[0].due.tv_nsec - now.tv_nsec) < SIM_POLL_INTERVAL ){
+        timeout.tv_nsec = (sim->heap[0].due.tv_sec - now.tv_sec) * 1000000000LL + (sim->heap[0].due.tv_nsec - now.tv_nsec);
+      }
+    }
+    
+    if( (ppoll(&pfd, 1, &timeout, NULL) == -1) && (errno != EINTR) ){
+      perror("ppoll");
+      break;
+    }
+    
+    while( (len = recv(sim->requests[1], packet, sizeof(packet), MSG_DONTWAIT)) > 0 ){
+      schedule_reply(sim, packet, len);
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    while( (sim->heap_count > 0) && (timespec_cmp(&now, &sim->heap[0].due) >= 0) ){
+      // like a full socket queue, a reply the pinger did not read in time is lost
+      if( send(sim->replies[1], sim->heap[0].packet, sim->heap[0].len, MSG_DONTWAIT) == -1 ){
+        if( (errno == EAGAIN) || (errno == EWOULDBLOCK) ){
+          __atomic_fetch_add(&sim->dropped, 1, __ATOMIC_RELAXED);
+        }
+        else {
+          perror("send");
+        }
+      }
+      
+      heap_pop(sim);
+    }
+  }
+  
+  return NULL;
+}
+
+// start a simulated network answering the echo requests sent on
+// *request_fd with echo replies read from *reply_fd, both are ip packets,
+// or the arp requests with arp replies in ethernet frames
+struct simulator *simulator_start(const struct simulator_config *config, uint32_t stream, int *request_fd, int *reply_fd)
+{
+  struct simulator *sim = malloc(sizeof(struct simulator));
+  
+  if( sim == NULL )
+    return NULL;
+  
+  bzero(sim, sizeof(struct simulator));
+  sim->config = *config;
+  
+  // each worker has its own sequence of random numbers
+  sim->rng = ((uint64_t)config->seed << 32 | stream) ^ 0x9e3779b97f4a7c15ULL;
+  if( sim->rng == 0 )
+    sim->rng = 1;
+  
+  if( socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sim->requests) == -1 ){
+    free(sim);
+    return NULL;
+  }
+  
+  if( socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sim->replies) == -1 ){
+    close(sim->requests[0]);
+    close(sim->requests[1]);
+    free(sim);
+    return NULL;
+  }
+  
+  simulator_set_queue(sim, SIM_MIN_QUEUE);
+  
+  sim->running = 1;
+  if( pthread_create(&sim->thread, NULL, thread_simulator, (void *)sim) != 0 ){
+    sim->running = 0;
+    simulator_stop(sim);
+    return NULL;
+  }
+  
+  *request_fd = sim->requests[0];
+  *reply_fd = sim->replies[0];
+  
+  return sim;
+}
+
+static void set_send_buffer(int sock, int size)
+{
+  // the FORCE variant goes over net.core.wmem_max but needs CAP_NET_ADMIN
+  if( setsockopt(sock, SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof(size)) == 0 )
+    return;
+  
+  if( setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) == -1 ){
+    perror("setsockopt(SO_SNDBUF) ");
+  }
+}
+
+// make room for packets requests and as many replies in flight, the
+// packets of a unix socket pair are charged to the send buffer of the
+// sender so a small one stalls the pinger or drops replies
+void simulator_set_queue(struct simulator *sim, uint32_t packets)
+{
+  uint64_t size;
+  
+  if( packets < SIM_MIN_QUEUE )
+    packets = SIM_MIN_QUEUE;
+  
+  size = (uint64_t) packets * SIM_PACKET_TRUESIZE;
+  if( size > INT_MAX / 2 )
+    size = INT_MAX / 2;
+  
+  set_send_buffer(sim->requests[0], (int) size);
+  set_send_buffer(sim->replies[1], (int) size);
+}
+
+uint64_t simulator_drops(struct simulator *sim)
+{
+  return __atomic_load_n(&sim->dropped, __ATOMIC_RELAXED);
+}
+
+void simulator_stop(struct simulator *sim)
+{
+  if( sim->running ){
+    sim->running = 0;
+    pthread_join(sim->thread, NULL);
+  }
+  
+  close(sim->requests[0]);
+  close(sim->requests[1]);
+  close(sim->replies[0]);
+  close(sim->replies[1]);
+  
+  if( sim->heap != NULL )
+    free(sim->heap);
+  
+  free(sim);
+}
+
+#endif
@@ -0,0 +1,152 @@
+#include "mruby-ping.h"
+
+#include <math.h>
+#include <strings.h> // bzero
+
+
+void latency_stats_reset(struct latency_stats *s)
+{
+  bzero(s, sizeof(struct latency_stats));
+}
+
+// account for one request, rtt is in usec and negative if no reply came back
+void latency_stats_add(struct latency_stats *s, mrb_int rtt)
+{
+  double delta;
+  
+  s->sent++;
+  
+  if( rtt < 0 )
+    return;
+  
+  if( s->received > 0 ){
+    // jitter: mean difference between two consecutive replies
+    s->jitter_sum += (rtt > s->last) ? (rtt - s->last) : (s->last - rtt);
+  }
+  
+  if( (s->received == 0) || (rtt < s->min) )
+    s->min = rtt;
+  
+  if( (s->received == 0) || (rtt > s->max) )
+    s->max = rtt;
+  
+  // running mean and variance (Welford)
+  s->received++;
+  delta = rtt - s->mean;
+  s->mean += delta / s->received;
+  s->m2 += delta * (rtt - s->mean);
+  
+  s->last = rtt;
+}
+
+// move the k-th smallest value at index k, smaller values end up
+// before it and bigger ones after it (quickselect)
+static void select_kth(mrb_int *values, uint32_t count, uint32_t k)
+{
+  uint32_t left = 0, right = count - 1;
+  
+  while( left < right ){
+    mrb_int pivot = values[left + (right - left) / 2], tmp;
+    uint32_t i = left, j = right;
+    
+    while( i <= j ){
+      while( values[i] < pivot ) i++;
+      while( values[j] > pivot ) j--;
+      
+      if( i <= j ){
+        tmp = values[i];
+        values[i] = values[j];
+        values[j] = tmp;
+        
+        i++;
+        if( j == 0 )
+          break;
+        
+        j--;
+      }
+    }
+    
+    if( k <= j )
+      right = j;
+    else if( k >= i )
+      left = i;
+    else
+      break;
+  }
+}
+
+// linear interpolation between the two closest ranks, values are reordered
+double latency_percentile(mrb_int *values, uint32_t count, double p)
+{
+  double rank = p * (count - 1), f;
+  uint32_t k, i;
+  mrb_int next;
+  
+  if( rank <= 0 )
+    rank = 0;
+  
+  k = (uint32_t) floor(rank);
+  if( k >= count - 1 ){
+    select_kth(values, count, count - 1);
+    return values[count - 1];
+  }
+  
+  f = rank - k;
+  select_kth(values, count, k);
+  
+  // everything after k is bigger or equal, the next rank is the smallest of them
+  next = values[k + 1];
+  for(i = k + 2; i< count; i++){
+    if( values[i] < next )
+      next = values[i];
+  }
+  
+  return values[k] + f * (next - values[k]);
+}
+
+// build [avg, loss, {percentile => latency}, min, max, stddev, jitter],
+// samples holds the s->received latencies and is reordered, the loss is nil
+// if nothing was sent
+mrb_value latency_stats_value(mrb_state *mrb, struct latency_stats *s, mrb_int *samples, mrb_value percentiles)
+{
+  mrb_value ret = mrb_ary_new_capa(mrb, 7);
+  mrb_value perc = mrb_hash_new(mrb);
+  mrb_value loss = mrb_nil_value();
+  
+  if( s->sent > 0 ){
+    loss = mrb_float_value(mrb, 100.0 * (s->sent - s->received) / s->sent);
+  }
+
+  // the percentiles are meaningless with less than 3 values
+  if( !mrb_nil_p(percentiles) && (s->received >= 3) ){
+    int i;
+    
+    for(i = 0; i< RARRAY_LEN(percentiles); i++){
+      mrb_value p = mrb_ary_ref(mrb, percentiles, i);
+      double value = latency_percentile(samples, s->received, mrb_float(mrb_to_flo(mrb, p)));
+      
+      mrb_hash_set(mrb, perc, p, mrb_float_value(mrb, value));
+    }
+  }
+  
+  if( s->received == 0 ){
+    mrb_ary_push(mrb, ret, mrb_nil_value());
+    mrb_ary_push(mrb, ret, loss);
+    mrb_ary_push(mrb, ret, perc);
+    mrb_ary_push(mrb, ret, mrb_nil_value());
+    mrb_ary_push(mrb, ret, mrb_nil_value());
+    mrb_ary_push(mrb, ret, mrb_nil_value());
+    mrb_ary_push(mrb, ret, mrb_nil_value());
+  }
+  else {
+    mrb_ary_push(mrb, ret, mrb_fixnum_value((mrb_int) (s->mean + 0.5)));
+    mrb_ary_push(mrb, ret, loss);
+    mrb_ary_push(mrb, ret, perc);
+    mrb_ary_push(mrb, ret, mrb_fixnum_value(s->min));
+    mrb_ary_push(mrb, ret, mrb_fixnum_value(s->max));
+    mrb_ary_push(mrb, ret, mrb_float_value(mrb, sqrt(s->m2 / s->received)));
+    mrb_ary_push(mrb, ret, (s->received > 1) ? mrb_float_value(mrb, s->jitter_sum / (s->received - 1)) : mrb_nil_value());
+  }
+  
+  return ret;
+}
@@ -0,0 +1,61 @@
+# these run against the :simulated backend, no packet leaves the host
+
+def simulated_pinger(simulation = {})
+  p = ICMPPinger.new(backend: :simulated, simulation: {min_delay: 1000, max_delay: 2000}.merge(simulation))
+  5.times{|n| p.add_target("10.0.0.#{n + 1}") }
+  p
+end
+
+assert('ICMPPinger simulated without loss') do
+  ret = simulated_pinger.send_pings(500, 5, 20, [0.5, 0.9])
+  
+  assert_equal 5, ret.size
+  ret.each do |key, (avg, loss, perc, min, max, stddev, jitter)|
+    assert_equal 0.0, loss
+    assert_true avg >= 1000
+    assert_true min >= 1000
+    assert_true (min <= avg) && (avg <= max)
+    assert_equal [0.5, 0.9], perc.keys
+    perc.each_value{|v| assert_true (min <= v) && (v <= max) }
+  end
+end
+
+assert('ICMPPinger simulated with full loss') do
+  ret = simulated_pinger(loss: 1.0).send_pings(200, 2, 20, [0.5])
+  
+  assert_equal 5, ret.size
+  ret.each_value do |avg, loss, perc, min, max, stddev, jitter|
+    assert_equal 100.0, loss
+    assert_nil avg
+    assert_nil min
+    assert_nil max
+    assert_equal({}, perc)
+  end
+end
+
+assert('ICMPPinger simulated add and remove targets') do
+  p = simulated_pinger
+  
+  assert_equal [100, 101, 102, 103, 104], p.send_pings(500).keys.sort
+  
+  assert_true p.remove_target('10.0.0.1')
+  assert_false p.remove_target('10.0.0.1')
+  assert_equal [101, 102, 103, 104], p.send_pings(500).keys.sort
+  
+  p.add_target('10.0.0.10')
+  ret = p.send_pings(500)
+  assert_equal [101, 102, 103, 104, 105], ret.keys.sort
+  ret.each_value{|r| assert_equal 0.0, r[1] }
+end
+
+assert('ARPPinger simulated') do
+  p = ARPPinger.simulated(min_delay: 1000, max_delay: 2000)
+  p.set_targets(%w(10.0.0.2 10.0.0.3 10.0.0.4))
+  ret = p.send_pings(500, 3, 20)
+  
+  assert_equal %w(10.0.0.2 10.0.0.3 10.0.0.4), ret.keys.sort
+  ret.each_value do |avg, loss, perc, min, max, stddev, jitter|
+    assert_equal 0.0, loss
+    assert_true avg >= 1000
+  end
+end
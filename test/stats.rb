@@ -0,0 +1,57 @@
+# the latency statistics, computed on the replies of the :simulated backend
+
+assert('ICMPPinger results shape') do
+  p = ICMPPinger.new(backend: :simulated, simulation: {min_delay: 1000, max_delay: 3000, jitter: 500})
+  p.add_target('10.0.0.1')
+  
+  ret = p.send_pings(500, 10, 20, [0.5])
+  assert_equal [100], ret.keys
+  
+  r = ret[100]
+  assert_equal 7, r.size
+  avg, loss, perc, min, max, stddev, jitter = r
+  assert_kind_of Integer, avg
+  assert_kind_of Float, loss
+  assert_kind_of Hash, perc
+  assert_kind_of Integer, min
+  assert_kind_of Integer, max
+  assert_kind_of Float, stddev
+  assert_kind_of Float, jitter
+end
+
+assert('ICMPPinger percentiles') do
+  p = ICMPPinger.new(backend: :simulated, simulation: {min_delay: 1000, max_delay: 3000, jitter: 2000, seed: 42})
+  p.add_target('10.0.0.1')
+  
+  avg, loss, perc, min, max = p.send_pings(900, 20, 20, [0.0, 0.5, 0.9, 1.0])[100]
+  
+  assert_equal 0.0, loss
+  assert_equal [0.0, 0.5, 0.9, 1.0], perc.keys
+  # the extremes are the min and max, the others are in order between them
+  assert_equal min.to_f, perc[0.0]
+  assert_equal max.to_f, perc[1.0]
+  assert_true perc[0.0] <= perc[0.5]
+  assert_true perc[0.5] <= perc[0.9]
+  assert_true perc[0.9] <= perc[1.0]
+end
+
+assert('ICMPPinger percentiles need 3 replies') do
+  p = ICMPPinger.new(backend: :simulated)
+  p.add_target('10.0.0.1')
+  
+  avg, loss, perc = p.send_pings(200, 2, 20, [0.5])[100]
+  assert_equal 0.0, loss
+  assert_equal({}, perc)
+end
+
+assert('ICMPPinger partial loss') do
+  p = ICMPPinger.new(backend: :simulated, simulation: {loss: 0.5, seed: 7})
+  p.add_target('10.0.0.1')
+  
+  avg, loss = p.send_pings(900, 20, 20)[100]
+  
+  # 5% per lost reply, the average only covers the received ones
+  assert_true (loss > 0.0) && (loss < 100.0)
+  assert_equal 0.0, (loss % 5.0)
+  assert_true avg >= 1000
+end